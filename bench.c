@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "queue.c"
+
+/*
+ * Throughput and latency sweep over every queue mode. For each mode it runs
+ * a grid of producer:consumer counts, batch sizes and offered item rates and
+ * prints ops/sec plus p50/p99/p999 of the enqueue-to-dequeue latency. Items
+ * carry their enqueue timestamp, so latency includes the time spent queued.
+ *
+ *   gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -pthread bench.c -o bench
+ *   ./bench [list|ring|lockfree|spsc|sharded]
+ *
+ * Add -DQUEUE_PACKED_LAYOUT to measure without the cache-line split of
+ * struct Queue, or -DQUEUE_STATS to also print the queue's own histograms.
+ * On multi-socket machines, compare runs pinned to one socket (numactl or
+ * taskset) against runs spread over several.
+ */
+
+#define BENCH_ITEMS 400000        // Items per run when the rate is unlimited
+#define BENCH_PACED_ITEMS 40000   // Items per run at a fixed offered rate
+#define BENCH_CAPACITY 1024       // Ring size of the bounded modes
+#define BENCH_SHARDS 4
+#define BENCH_MAX_THREADS 8
+
+typedef enum BenchMode {
+    BENCH_LIST,
+    BENCH_RING,
+    BENCH_LOCKFREE,
+    BENCH_SPSC,
+    BENCH_SHARDED,
+    BENCH_MODES,
+} BenchMode;
+
+static const char *bench_mode_names[BENCH_MODES] = {"list", "ring", "lockfree", "spsc", "sharded"};
+
+static const int bench_threads[][2] = {{1, 1}, {1, 4}, {4, 1}, {4, 4}};
+static const size_t bench_batches[] = {1, 16};
+static const long bench_rates[] = {0, 200000};  // Items/s over all producers, 0 = flat out
+
+typedef struct BenchRun {
+    BenchMode mode;
+    Queue *q;
+    ShardedQueue *sq;
+    size_t batch;
+    long rate;
+} BenchRun;
+
+typedef struct BenchThread {
+    BenchRun *run;
+    size_t count;           // Producers: items to enqueue
+    long interval_ns;       // Producers: pacing, 0 for none
+    QueueHistogram latency; // Consumers: enqueue-to-dequeue latency
+} BenchThread;
+
+uint64_t bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void bench_record(QueueHistogram *h, void *item)
+{
+    uint64_t ns = bench_now() - (uint64_t)(uintptr_t)item;
+    h->count++;
+    h->sum_ns += ns;
+    h->max_ns = ns > h->max_ns ? ns : h->max_ns;
+    h->buckets[StatsBucket(ns)]++;
+}
+
+void bench_merge(QueueHistogram *dst, const QueueHistogram *src)
+{
+    dst->count += src->count;
+    dst->sum_ns += src->sum_ns;
+    dst->max_ns = src->max_ns > dst->max_ns ? src->max_ns : dst->max_ns;
+    for (size_t b = 0; b < QUEUE_STATS_BUCKETS; b++)
+    {
+        dst->buckets[b] += src->buckets[b];
+    }
+}
+
+void bench_pace(uint64_t *next, long interval_ns)
+{
+    if (interval_ns == 0)
+    {
+        return;
+    }
+    *next += interval_ns;
+    uint64_t now = bench_now();
+    if (*next > now + 50000)
+    {
+        uint64_t gap = *next - now;
+        thrd_sleep(&(struct timespec){gap / 1000000000u, gap % 1000000000u}, NULL);
+    }
+    while (bench_now() < *next)
+    {
+        CpuRelax();
+    }
+}
+
+int bench_producer(void *arg)
+{
+    BenchThread *t = (BenchThread *)arg;
+    BenchRun *run = t->run;
+    void *items[16];
+    uint64_t next = bench_now();
+
+    for (size_t done = 0; done < t->count;)
+    {
+        size_t n = t->count - done < run->batch ? t->count - done : run->batch;
+        for (size_t i = 0; i < n; i++)
+        {
+            bench_pace(&next, t->interval_ns);
+            items[i] = (void *)(uintptr_t)bench_now();
+        }
+        if (run->mode == BENCH_SHARDED)
+        {
+            shardedEnqueue(run->sq, items[0]);
+        }
+        else if (n == 1)
+        {
+            queueEnqueue(run->q, items[0]);
+        }
+        else
+        {
+            queueEnqueueMany(run->q, items, n);
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int bench_consumer(void *arg)
+{
+    BenchThread *t = (BenchThread *)arg;
+    BenchRun *run = t->run;
+    void *items[16];
+
+    // The queue is closed once every producer is done
+    if (run->mode == BENCH_SHARDED)
+    {
+        void *item;
+        while ((item = shardedDequeue(run->sq)) != NULL)
+        {
+            bench_record(&t->latency, item);
+        }
+        return 0;
+    }
+
+    size_t n;
+    while ((n = queueDequeueMany(run->q, items, run->batch)) > 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            bench_record(&t->latency, items[i]);
+        }
+    }
+    return 0;
+}
+
+void bench_one(BenchMode mode, int producers, int consumers, size_t batch, long rate)
+{
+    static BenchThread threads[2 * BENCH_MAX_THREADS];
+    thrd_t ids[2 * BENCH_MAX_THREADS];
+    BenchRun run = {mode, NULL, NULL, batch, rate};
+    size_t per_producer = (rate > 0 ? BENCH_PACED_ITEMS : BENCH_ITEMS) / producers;
+
+    switch (mode)
+    {
+    case BENCH_RING:
+        run.q = queueCreateBounded(BENCH_CAPACITY);
+        break;
+    case BENCH_LOCKFREE:
+        run.q = queueCreateLockFree(BENCH_CAPACITY);
+        break;
+    case BENCH_SPSC:
+        run.q = queueCreateSpsc(BENCH_CAPACITY);
+        break;
+    case BENCH_SHARDED:
+        run.sq = shardedQueueCreate(BENCH_SHARDS);
+        break;
+    default:
+        run.q = queueCreate();
+        break;
+    }
+
+    uint64_t start = bench_now();
+    for (int i = 0; i < consumers; i++)
+    {
+        threads[i] = (BenchThread){.run = &run};
+        thrd_create(&ids[i], bench_consumer, &threads[i]);
+    }
+    for (int i = consumers; i < consumers + producers; i++)
+    {
+        threads[i] = (BenchThread){
+            .run = &run,
+            .count = per_producer,
+            .interval_ns = rate > 0 ? 1000000000L / (rate / producers) : 0,
+        };
+        thrd_create(&ids[i], bench_producer, &threads[i]);
+    }
+    for (int i = consumers; i < consumers + producers; i++)
+    {
+        thrd_join(ids[i], NULL);
+    }
+    if (run.q != NULL)
+    {
+        queueClose(run.q);
+    }
+    else
+    {
+        shardedQueueClose(run.sq);
+    }
+    QueueHistogram latency = {0};
+    for (int i = 0; i < consumers; i++)
+    {
+        thrd_join(ids[i], NULL);
+        bench_merge(&latency, &threads[i].latency);
+    }
+    double elapsed = (bench_now() - start) / 1e9;
+
+    printf("%-9s %d:%-3d %5zu %9ld %10.0f %10.1f %10.1f %10.1f\n",
+           bench_mode_names[mode], producers, consumers, batch, rate,
+           latency.count / elapsed,
+           queueHistogramPercentile(&latency, 50) / 1e3,
+           queueHistogramPercentile(&latency, 99) / 1e3,
+           queueHistogramPercentile(&latency, 99.9) / 1e3);
+
+    queueDestroy(run.q);
+    shardedQueueDestroy(run.sq);
+}
+
+#ifdef QUEUE_STATS
+void print_stats()
+{
+    static const char *names[QUEUE_STAT_COUNT] = {
+        "lock wait", "lock hold", "park", "sojourn", "wake",
+    };
+    static QueueStats stats;
+    queueStats(&stats);
+    printf("lock acquires %llu, contended %llu\n",
+           (unsigned long long)stats.lock_acquires,
+           (unsigned long long)stats.lock_contended);
+    for (int id = 0; id < QUEUE_STAT_COUNT; id++)
+    {
+        QueueHistogram *h = &stats.hist[id];
+        printf("%-9s n=%-10llu p50=%-8llu p99=%-8llu max=%llu ns\n", names[id],
+               (unsigned long long)h->count,
+               (unsigned long long)queueHistogramPercentile(h, 50),
+               (unsigned long long)queueHistogramPercentile(h, 99),
+               (unsigned long long)h->max_ns);
+    }
+}
+#endif
+
+int main(int argc, char **argv)
+{
+#ifdef QUEUE_PACKED_LAYOUT
+    printf("layout: packed, sizeof(Queue) = %zu\n", sizeof(Queue));
+#else
+    printf("layout: split, sizeof(Queue) = %zu\n", sizeof(Queue));
+#endif
+    printf("%-9s %-5s %5s %9s %10s %10s %10s %10s\n", "mode", "P:C", "batch",
+           "rate/s", "ops/s", "p50 us", "p99 us", "p999 us");
+
+    for (int mode = 0; mode < BENCH_MODES; mode++)
+    {
+        if (argc > 1 && strcmp(argv[1], bench_mode_names[mode]) != 0)
+        {
+            continue;
+        }
+        for (size_t t = 0; t < sizeof(bench_threads) / sizeof(bench_threads[0]); t++)
+        {
+            // SPSC queues allow exactly one producer and one consumer
+            if (mode == BENCH_SPSC && (bench_threads[t][0] != 1 || bench_threads[t][1] != 1))
+            {
+                continue;
+            }
+            for (size_t b = 0; b < sizeof(bench_batches) / sizeof(bench_batches[0]); b++)
+            {
+                // The sharded queue has no batch calls
+                if (mode == BENCH_SHARDED && bench_batches[b] > 1)
+                {
+                    continue;
+                }
+                for (size_t r = 0; r < sizeof(bench_rates) / sizeof(bench_rates[0]); r++)
+                {
+                    bench_one(mode, bench_threads[t][0], bench_threads[t][1],
+                              bench_batches[b], bench_rates[r]);
+                }
+            }
+        }
+    }
+#ifdef QUEUE_STATS
+    print_stats();
+#endif
+    return 0;
+}
@@ -1,263 +1,4447 @@
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <threads.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#ifdef QUEUE_NUMA
+#include <numa.h>
+#include <sched.h>
+#endif
+#include "queue.h"
 
 /* -------------------Data Structures ----------------*/
 
 typedef struct Node {
   void *data;
   struct Node *next;
+  uint64_t deadline;    // Absolute TIME_UTC nanoseconds, 0 for none
+#ifdef QUEUE_STATS
+  uint64_t stamp;       // When the item was stored, for its sojourn time
+#endif
 } Node;
 
-typedef struct Queue {
-  Node *head;
-  Node *tail;
-  size_t item_count;
-  size_t wait_count;
-  size_t visited_count;
-  mtx_t mtx;
-} Queue;
+/*
+ * A QueueLink embedded in a caller's object is used as the list node for
+ * that object, with data pointing back at the link itself. Pool nodes never
+ * point at themselves, which is how the two kinds are told apart.
+ */
+_Static_assert(sizeof(Node) <= sizeof(QueueLink) && _Alignof(Node) <= _Alignof(QueueLink),
+               "QueueLink must be able to hold a Node");
+
+static inline Node *LinkNode(QueueLink *link) {
+  return (Node *)link;
+}
+
+static inline bool IsLinkNode(const Node *node) {
+  return node->data == node;
+}
+
+/*
+ * Nodes are carved out of slab chunks and recycled through an intrusive
+ * freelist, so the steady state of enqueue/dequeue does no heap calls while
+ * holding the queue lock. Chunks are only released when the queue is destroyed.
+ */
+#define NODE_CHUNK_MIN 64
+#define NODE_CHUNK_MAX 4096
+
+typedef struct NodeChunk {
+  struct NodeChunk *next;
+  size_t count;
+  Node nodes[];
+} NodeChunk;
+
+typedef struct NodePool {
+  Node *free_list;      // Recycled nodes, linked through Node.next
+  NodeChunk *chunks;    // Every chunk ever allocated
+  size_t next_chunk;    // Size of the next chunk to allocate
+  int numa_node;        // NUMA node chunks (and the queue handle) live on, -1 for any
+} NodePool;
+
+/*
+ * Lock-free mode uses a bounded MPMC ring where every slot carries a
+ * sequence number (Vyukov). A slot at position pos is free for the producer
+ * claiming pos when seq == pos, and holds an item for the consumer claiming
+ * pos when seq == pos + 1.
+ */
+typedef struct LfSlot {
+  atomic_size_t seq;
+  void *item;
+#ifdef QUEUE_STATS
+  uint64_t stamp;
+#endif
+} LfSlot;
+
+/*
+ * Persistent mode keeps a ring of fixed-size payloads in a memory-mapped
+ * file: a header page followed by the slots. The header holds the head and
+ * tail as last committed by PersistSync(); reopening the file resumes from
+ * there. Producers only reuse slots behind the committed head, so whatever
+ * a crash rolls back to is still intact.
+ *
+ * The mapping is shared, so every store to the header is in the file the
+ * moment it is made. Commits therefore alternate between two records, each
+ * with a sequence number and a checksum: a crash halfway through writing
+ * one leaves a record that fails its check, and the other still holds the
+ * previous commit.
+ */
+typedef struct PersistCommitRecord {
+  uint64_t seq;          // Commit number, the higher valid record wins
+  uint64_t head;
+  uint64_t tail;
+  uint64_t check;        // PersistCheck() of the fields above
+} PersistCommitRecord;
+
+typedef struct PersistHeader {
+  uint64_t magic;        // PERSIST_MAGIC once the file is initialized
+  uint64_t capacity;     // Slots, a power of two
+  uint64_t item_size;    // Bytes per payload
+  PersistCommitRecord commits[2];  // Commit seq goes to commits[seq & 1]
+} PersistHeader;
+
+typedef struct PersistRing {
+  int fd;
+  unsigned char *map;        // The whole file
+  size_t map_size;
+  size_t page_size;
+  size_t item_size;
+  PersistHeader *header;     // First page of map, the slots start on the next
+  size_t synced_head;        // Indices as last committed to the header
+  size_t synced_tail;
+  uint64_t synced_seq;       // Sequence number of that commit
+  size_t unsynced;           // Commits since then
+  size_t item_waiters;       // Consumers blocked on an empty ring
+  cnd_t item_cv;
+} PersistRing;
 
+/*
+ * Waiter records live in the blocked thread's stack frame for the duration
+ * of its dequeue() call, so blocking allocates nothing. Producers fill the
+ * oldest waiter's items directly and wake exactly that thread.
+ */
 typedef struct CvNode {
-  cnd_t *cv;
+  cnd_t cv;
+  void **items;   // Where items handed to this waiter go
+  size_t max;     // Capacity of items
+  size_t taken;   // Items handed over so far; nonzero once served
+  struct CvNode *prev;
   struct CvNode *next;
+  struct CvSelect *select;  // dequeueAny() group the record belongs to, or NULL
+  struct CvAsync *async;    // dequeueAsync() record this is part of, or NULL
+  bool queued;              // Still linked into the FIFO; select records only
+  bool pinned;              // Select records: holding a parked count on the queue
+  bool retired;             // Select records: queue found closed and empty, left alone
+#ifdef QUEUE_STATS
+  uint64_t signaled_at;  // When a producer woke us, for wake-to-run latency
+#endif
 } CvNode;
 
+/*
+ * A consumer in queueDequeueAny() links one record into the FIFO of every
+ * queue it waits on, all pointing at one CvSelect on its stack, and sleeps
+ * on the group's condvar. Whoever serves a record first claims the group
+ * under its mutex, always taken after the queue lock; records of a claimed
+ * group are dead and get unlinked by whoever meets them next.
+ */
+typedef struct CvSelect {
+  mtx_t mtx;
+  cnd_t cv;
+  CvNode *records;  // One per queue, in the caller's order
+  void *item;       // The item handed over
+  size_t which;     // Index of the record that was served, SIZE_MAX if none
+  bool woken;       // Served, or released by queueClose()
+} CvSelect;
+
+/*
+ * A consumer in queueDequeueAsync() leaves a heap record in the FIFO in
+ * place of its thread. Whoever serves the record moves it to the queue's
+ * completed list; QueueUnlock() then runs the callbacks once the lock is
+ * released.
+ */
+typedef struct CvAsync {
+  CvNode node;            // Linked into the FIFO like a blocking waiter's
+  void *item;             // Where the item handed over goes
+  QueueAsyncFn fn;
+  void *ctx;
+  Queue *queue;           // Whose executor runs fn
+  struct CvAsync *next;   // Completed records of one queue or thread
+} CvAsync;
+
 typedef struct CvQueue {
   CvNode *head;
   CvNode *tail;
 } CvQueue;
 
-static Queue queue;      // Queue instance (private)
-static CvQueue cvQueue;  // Queue of conditional variables (private)
+/*
+ * Producers blocked on a full ring queue up the same way, oldest first, in
+ * records on their own stacks. A consumer that frees a slot moves the next
+ * item of the oldest producer into it and wakes that producer once all of
+ * its items are stored, so it never has to retake the lock to finish.
+ */
+typedef struct PwNode {
+  cnd_t cv;
+  void **items;        // The producer's items, in order
+  size_t count;
+  size_t stored;       // Items moved into the ring so far
+  uint64_t deadline;   // Deadline of a single item, 0 for none
+  struct PwNode *next;
+} PwNode;
+
+typedef struct PwQueue {
+  PwNode *head;
+  PwNode *tail;
+} PwQueue;
+
+/*
+ * Fields written on the producer and consumer paths live on separate cache
+ * lines. Building with QUEUE_PACKED_LAYOUT drops the padding, which is only
+ * useful to measure what the split buys, see bench.c.
+ */
+#ifdef QUEUE_PACKED_LAYOUT
+#define CACHE_ALIGNED
+#else
+#define CACHE_ALIGNED _Alignas(QUEUE_CACHE_LINE_SIZE)
+#endif
+
+/*
+ * Counters are only written by the thread holding the queue lock, except in
+ * lock-free mode where item and visit counts come from the ring positions.
+ * seq is a seqlock: it is odd whenever some thread holds the lock, so
+ * snapshotStats() can read all three counters consistently without locking.
+ */
+typedef struct QueueCounters {
+  atomic_size_t seq;
+  atomic_size_t item_count;     // Unused in lock-free mode, see queueSize()
+  atomic_size_t visited_count;  // Unused in lock-free mode, see queueVisited()
+  atomic_size_t wait_count;     // Read without the lock by lock-free producers
+} QueueCounters;
+
+typedef enum QueueMode {
+  QUEUE_MODE_LIST,      // Unbounded linked list of pooled nodes
+  QUEUE_MODE_RING,      // Bounded power-of-two ring of item pointers
+  QUEUE_MODE_LOCKFREE,  // Bounded lock-free MPMC ring, mutex only to sleep
+  QUEUE_MODE_SPSC,      // Bounded wait-free ring for one producer and one consumer
+  QUEUE_MODE_PERSISTENT,  // Bounded ring of payload copies in a mapped file
+} QueueMode;
+
+struct Queue {
+  // Read-mostly, only written by init, setSpinLimit() and setExecutor()
+  QueueMode mode;
+  void **ring;            // Ring and SPSC mode: slots, capacity is mask + 1
+  LfSlot *slots;          // Lock-free mode: slots, capacity is mask + 1
+  PersistRing *persist;   // Persistent mode: the mapped file, capacity is mask + 1
+  size_t mask;
+  atomic_size_t spin_limit;     // Upper bound for spin_budget, 0 disables spinning
+  atomic_bool closed;           // Set once by queueClose()
+  int notify_fd;                // Readable end of the notification fd, or -1
+  int notify_wfd;               // Writable end, the same fd for an eventfd
+  QueueExecutorFn executor;     // Runs dequeueAsync() callbacks, NULL to run them inline
+  void *executor_ctx;
+
+  // Producer side, written by every enqueue
+  CACHE_ALIGNED Node *tail;     // List mode
+  size_t ring_tail;             // Ring and persistent mode: next slot to write
+  atomic_size_t enqueue_pos;    // Lock-free and SPSC mode
+  size_t head_cache;            // SPSC mode: last dequeue_pos the producer saw
+  atomic_size_t space_waiters;  // Producers blocked on a full ring, see queueWaitingProducers()
+  cnd_t space_cv;
+
+  // Consumer side, written by every dequeue
+  CACHE_ALIGNED Node *head;     // List mode
+  size_t ring_head;             // Ring and persistent mode: next slot to read
+  atomic_size_t dequeue_pos;    // Lock-free and SPSC mode
+  size_t tail_cache;            // SPSC mode: last enqueue_pos the consumer saw
+  atomic_size_t spin_budget;    // Current pre-park spin budget, in pause units
+
+  // Read lock-free by size()/waiting()/visited(), so kept off the lines
+  // holding the lock and the list or ring state
+  CACHE_ALIGNED QueueCounters counters;
+  atomic_bool notify_raised;    // notify_fd is readable, see NotifyRaise()
+  atomic_size_t deadline_items; // Stored items with a deadline, see StoreExpire()
+
+  // Only touched with the lock held
+  CACHE_ALIGNED mtx_t mtx;
+  NodePool pool;
+  CvQueue waiters;              // Queue of conditional variables
+  PwQueue producers;            // Ring mode: producers blocked on a full ring
+  CvAsync *completed;           // Served dequeueAsync() records, see QueueUnlock()
+  CvAsync *completed_tail;
+  size_t parked;                // Threads inside QueueWait(), see QueueFinalize()
+  unsigned prio_levels;         // List mode: bit p - 1 set if level p is non-empty
+  Node *prio_head[QUEUE_PRIORITY_MAX];  // Levels 1..QUEUE_PRIORITY_MAX
+  Node *prio_tail[QUEUE_PRIORITY_MAX];
+  uint64_t *ring_deadlines;     // Ring mode: per-slot deadlines, allocated on first use
+  QueueDrainFn reclaim;         // Receives expired items, see queueSetReclaim()
+  void *reclaim_ctx;
+  void **expired;               // Expired items for reclaim, see QueueUnlock()
+  size_t expired_count;
+  size_t expired_cap;
+#ifdef QUEUE_STATS
+  uint64_t *ring_stamps;        // Ring mode: per-slot store times
+  uint64_t locked_at;           // When the current holder took the lock
+#endif
+};
+
+#ifndef QUEUE_PACKED_LAYOUT
+_Static_assert(_Alignof(Queue) == QUEUE_CACHE_LINE_SIZE,
+               "Queue handles must start on a cache line");
+#endif
+
+/*
+ * A sharded queue spreads one logical queue over several independent Queue
+ * instances. Each thread pushes to and pops from its home shard and steals
+ * from the others when that one is empty, so ordering is only FIFO per shard.
+ * Consumers that find every shard empty sleep on a single idle condvar.
+ */
+struct ShardedQueue {
+  Queue **shards;
+  size_t shard_count;
+  size_t node_count;         // NUMA nodes the shards are grouped by
+  size_t shards_per_node;    // Shard i lives on node i / shards_per_node
+  atomic_size_t idle_count;  // Consumers asleep in shardedDequeue()
+  atomic_bool closed;        // Set by shardedQueueClose()
+  mtx_t idle_mtx;
+  cnd_t idle_cv;
+};
+
+static Queue defaultQueue;  // Instance behind initQueue()/enqueue()/... (private)
+
+/* -------------------NUMA Placement ----------------*/
+
+/*
+ * Built with QUEUE_NUMA and linked with -lnuma, a queue can be placed on a
+ * NUMA node: its handle and every node slab come from that node's memory.
+ * Without QUEUE_NUMA, or on a kernel without NUMA support, every request for
+ * a node falls back to plain heap memory and the machine counts as one node.
+ */
+
+static once_flag numaOnce = ONCE_FLAG_INIT;
+static size_t numaNodes;                   // 0 when NUMA placement is unavailable
+#ifdef QUEUE_NUMA
+static _Thread_local int threadNode = -1;  // Node of the calling thread, once looked up
+#endif
+
+static void NumaProbe(void) {
+#ifdef QUEUE_NUMA
+  if (numa_available() >= 0) {
+    numaNodes = (size_t)numa_max_node() + 1;
+  }
+#endif
+}
 
 /**
- * @brief Initialize the queue
+ * @brief Get the number of NUMA nodes memory can be placed on
+ * @return The node count, or 0 if placement is unavailable
  */
-void initQueue(void) {
-  // Initialize the queue
-  queue.head = NULL;
-  queue.tail = NULL;
-  queue.item_count = 0;
-  queue.wait_count = 0;
-  queue.visited_count = 0;
-  mtx_init(&queue.mtx, mtx_plain);  // Initialize mutex
+static size_t NumaNodeCount(void) {
+  call_once(&numaOnce, NumaProbe);
+  return numaNodes;
+}
 
-  // Initialize the conditional variables queue
-  cvQueue.head = NULL;
-  cvQueue.tail = NULL;
+/**
+ * @brief Validate a requested NUMA node
+ * @return node if memory can be placed on it, otherwise -1
+ */
+static int NumaNode(int node) {
+  return node >= 0 && (size_t)node < NumaNodeCount() ? node : -1;
 }
 
 /**
- * @brief Destroy the queue and clean up resources
+ * @brief Get the NUMA node the calling thread runs on
+ *
+ * Looked up once per thread, so threads are expected to stay on their
+ * socket (pin them); 0 when placement is unavailable.
  */
-void destroyQueue(void) {
-  // Clean up the data queue
-  Node *current = queue.head;
-  while (current != NULL) {
-    Node *next = current->next;
-    free(current);
-    current = NULL;
-    current = next;
+static size_t ThreadNumaNode(void) {
+#ifdef QUEUE_NUMA
+  if (threadNode < 0) {
+    int cpu = sched_getcpu();
+    int node = cpu >= 0 && NumaNodeCount() > 0 ? numa_node_of_cpu(cpu) : 0;
+    threadNode = node >= 0 ? node : 0;
   }
+  return (size_t)threadNode;
+#else
+  return 0;
+#endif
+}
 
-  mtx_destroy(&queue.mtx);  // Destroy mutex
+/**
+ * @brief Allocate cache-line aligned memory on a NUMA node
+ * @param node A node validated by NumaNode(), or -1 for the heap
+ * @return The memory, or NULL if the allocation failed
+ */
+static void *NumaAlloc(int node, size_t size) {
+#ifdef QUEUE_NUMA
+  if (node >= 0) {
+    return numa_alloc_onnode(size, node);  // Whole pages, so aligned as well
+  }
+#endif
+  (void)node;
+  size_t line = QUEUE_CACHE_LINE_SIZE;
+  return aligned_alloc(line, (size + line - 1) / line * line);
+}
 
-  // Clean up the conditional variables queue
-  CvNode *cv_current = cvQueue.head;
-  while (cv_current != NULL) {
-    CvNode *cv_next = cv_current->next;
-    cnd_destroy(cv_current->cv);  // Destroy conditional variable
-    free(cv_current->cv);
-    cv_current->cv = NULL;
-    free(cv_current);
-    cv_current = NULL;
-    cv_current = cv_next;
+/**
+ * @brief Release memory from NumaAlloc()
+ * @param node The node and size it was allocated with
+ */
+static void NumaFree(int node, void *ptr, size_t size) {
+#ifdef QUEUE_NUMA
+  if (node >= 0) {
+    if (ptr != NULL) {
+      numa_free(ptr, size);
+    }
+    return;
   }
+#endif
+  (void)node;
+  (void)size;
+  free(ptr);
+}
 
-  // Reset queue values
-  queue.head = NULL;
-  queue.tail = NULL;
-  queue.item_count = 0;
-  queue.wait_count = 0;
-  queue.visited_count = 0;
+/* -------------------Node Pool ----------------*/
+
+/**
+ * @brief Add a chunk of count nodes to the pool's freelist
+ * @return True on success, false if the allocation failed
+ */
+static bool PoolGrow(NodePool *pool, size_t count) {
+  NodeChunk *chunk = NumaAlloc(pool->numa_node, sizeof(NodeChunk) + count * sizeof(Node));
+  if (chunk == NULL) {
+    return false;
+  }
+  chunk->count = count;
+  chunk->next = pool->chunks;
+  pool->chunks = chunk;
+
+  for (size_t i = 0; i < count; i++) {
+    chunk->nodes[i].next = pool->free_list;
+    pool->free_list = &chunk->nodes[i];
+  }
+  return true;
 }
 
 /**
- * @brief Check if the conditional variables queue is empty
- * @return True if the queue is empty, false otherwise
+ * @brief Take a node from the pool, growing it if the freelist is empty
+ * @return A node, or NULL if the pool could not grow
  */
-bool IsCvQueueEmpty(void) {
-  return cvQueue.head == NULL;
+static Node *PoolAlloc(NodePool *pool) {
+  if (pool->free_list == NULL) {
+    if (!PoolGrow(pool, pool->next_chunk)) {
+      return NULL;
+    }
+    if (pool->next_chunk < NODE_CHUNK_MAX) {
+      pool->next_chunk *= 2;
+    }
+  }
+  Node *node = pool->free_list;
+  pool->free_list = node->next;
+  return node;
 }
 
 /**
- * @brief Check if the data queue is empty
- * @return True if the queue is empty, false otherwise
+ * @brief Return a node to the pool's freelist
  */
-bool IsQueueEmpty(void) {
-  return queue.head == NULL;
+static void PoolFree(NodePool *pool, Node *node) {
+  node->next = pool->free_list;
+  pool->free_list = node;
 }
 
 /**
- * @brief Enqueue an item into the data queue
- * @param item The item to enqueue
+ * @brief Release every chunk owned by the pool
  */
-void enqueue(void *item) {
-  mtx_lock(&queue.mtx);  // Lock the mutex because we are modifying the queue
+static void PoolRelease(NodePool *pool) {
+  NodeChunk *chunk = pool->chunks;
+  while (chunk != NULL) {
+    NodeChunk *next = chunk->next;
+    NumaFree(pool->numa_node, chunk, sizeof(NodeChunk) + chunk->count * sizeof(Node));
+    chunk = next;
+  }
+  pool->chunks = NULL;
+  pool->free_list = NULL;
+  pool->next_chunk = NODE_CHUNK_MIN;
+}
+
+/* -------------------Instrumentation ----------------*/
 
-  bool queue_was_empty = false;
-  if (IsQueueEmpty()) {
-    queue_was_empty = true;
+/*
+ * Built with QUEUE_STATS, every thread that touches a queue records lock
+ * wait and hold times, park durations, item sojourn times and wake-to-run
+ * latencies into its own set of log-linear histograms. Only the owner writes
+ * them, with plain relaxed stores, so recording costs a clock read and no
+ * shared cache line. queueStats() sums all threads, live and exited. Without
+ * QUEUE_STATS every hook below compiles to nothing.
+ */
+
+/**
+ * @brief Histogram bucket of a duration: 4 sub-buckets per power of two
+ */
+static inline size_t StatsBucket(uint64_t ns) {
+  if (ns < 4) {
+    return (size_t)ns;
   }
+  int exp = 63 - __builtin_clzll(ns);
+  return (size_t)(exp - 1) * 4 + ((ns >> (exp - 2)) & 3);
+}
 
-  // Insert item into the data queue
-  Node *node = malloc(sizeof(Node));
-  node->data = item;
-  node->next = NULL;
+#ifdef QUEUE_STATS
+
+typedef struct StatsHistogram {
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t sum_ns;
+  atomic_uint_fast64_t max_ns;
+  atomic_uint_fast64_t buckets[QUEUE_STATS_BUCKETS];
+} StatsHistogram;
+
+typedef struct ThreadStats {
+  struct ThreadStats *next;
+  atomic_uint_fast64_t lock_acquires;
+  atomic_uint_fast64_t lock_contended;
+  StatsHistogram hist[QUEUE_STAT_COUNT];
+} ThreadStats;
+
+static once_flag statsOnce = ONCE_FLAG_INIT;
+static mtx_t statsMtx;                  // Guards statsThreads and statsRetired
+static tss_t statsKey;                  // Retires a thread's stats at exit
+static ThreadStats *statsThreads;       // Stats of every live thread
+static QueueStats statsRetired;         // Sum over exited threads
+static _Thread_local ThreadStats *threadStats;
+
+/**
+ * @brief Monotonic clock in nanoseconds
+ */
+static inline uint64_t StatsNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline void StatsBump(atomic_uint_fast64_t *v, uint64_t n) {
+  atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n,
+                        memory_order_relaxed);
+}
 
-  if (IsQueueEmpty()) {
-    queue.head = node;
-    queue.tail = node;
-  } else {  // If the queue is not empty
-    queue.tail->next = node;
-    queue.tail = node;
+/**
+ * @brief Add the counters of ts to out
+ */
+static void StatsMerge(QueueStats *out, ThreadStats *ts) {
+  out->lock_acquires += atomic_load_explicit(&ts->lock_acquires, memory_order_relaxed);
+  out->lock_contended += atomic_load_explicit(&ts->lock_contended, memory_order_relaxed);
+  for (int id = 0; id < QUEUE_STAT_COUNT; id++) {
+    StatsHistogram *src = &ts->hist[id];
+    QueueHistogram *dst = &out->hist[id];
+    uint64_t max = atomic_load_explicit(&src->max_ns, memory_order_relaxed);
+    dst->count += atomic_load_explicit(&src->count, memory_order_relaxed);
+    dst->sum_ns += atomic_load_explicit(&src->sum_ns, memory_order_relaxed);
+    dst->max_ns = max > dst->max_ns ? max : dst->max_ns;
+    for (size_t b = 0; b < QUEUE_STATS_BUCKETS; b++) {
+      dst->buckets[b] += atomic_load_explicit(&src->buckets[b], memory_order_relaxed);
+    }
   }
+}
 
-  queue.item_count++;
-  queue.visited_count++;
+/**
+ * @brief tss destructor: fold an exiting thread's stats into statsRetired
+ */
+static void StatsThreadExit(void *arg) {
+  ThreadStats *ts = arg;
 
-  // Signal waiting thread if there are any
-  if (queue.wait_count > 0 && queue_was_empty) {
-    cnd_signal(cvQueue.head->cv);
+  mtx_lock(&statsMtx);
+  StatsMerge(&statsRetired, ts);
+  ThreadStats **link = &statsThreads;
+  while (*link != ts) {
+    link = &(*link)->next;
   }
+  *link = ts->next;
+  mtx_unlock(&statsMtx);
+
+  threadStats = NULL;
+  free(ts);
+}
 
-  mtx_unlock(&queue.mtx);
+static void StatsInit(void) {
+  mtx_init(&statsMtx, mtx_plain);
+  tss_create(&statsKey, StatsThreadExit);
 }
 
 /**
- * @brief Dequeue an item from the data queue
- * @return The dequeued item
+ * @brief This thread's stats, registered on first use
+ * @return The stats, or NULL if they could not be allocated
  */
-void *dequeue(void) {
-  mtx_lock(&queue.mtx);
+static ThreadStats *StatsThread(void) {
+  if (threadStats == NULL) {
+    call_once(&statsOnce, StatsInit);
+    ThreadStats *ts = calloc(1, sizeof(ThreadStats));
+    if (ts == NULL) {
+      return NULL;
+    }
+    mtx_lock(&statsMtx);
+    ts->next = statsThreads;
+    statsThreads = ts;
+    mtx_unlock(&statsMtx);
+    tss_set(statsKey, ts);
+    threadStats = ts;
+  }
+  return threadStats;
+}
+
+/**
+ * @brief Record one sample of a duration
+ */
+static void StatsRecord(QueueStatId id, uint64_t ns) {
+  ThreadStats *ts = StatsThread();
+  if (ts == NULL) {
+    return;
+  }
+  StatsHistogram *h = &ts->hist[id];
+  StatsBump(&h->count, 1);
+  StatsBump(&h->sum_ns, ns);
+  StatsBump(&h->buckets[StatsBucket(ns)], 1);
+  if (ns > atomic_load_explicit(&h->max_ns, memory_order_relaxed)) {
+    atomic_store_explicit(&h->max_ns, ns, memory_order_relaxed);
+  }
+}
 
-  if (IsCvQueueEmpty() && !IsQueueEmpty()) {
-    // Dequeue from the data queue
-    Node *node = queue.head;
-    void *item = node->data;
-    queue.head = node->next;
-    queue.item_count--;
+/**
+ * @brief Take the queue mutex, recording how long that took
+ */
+static void StatsLock(Queue *q) {
+  ThreadStats *ts = StatsThread();
+  uint64_t wait = 0;
 
-    if (IsQueueEmpty()) {
-      queue.tail = NULL;
+  if (mtx_trylock(&q->mtx) != thrd_success) {
+    uint64_t start = StatsNow();
+    mtx_lock(&q->mtx);
+    wait = StatsNow() - start;
+    if (ts != NULL) {
+      StatsBump(&ts->lock_contended, 1);
     }
+  }
+  if (ts != NULL) {
+    StatsBump(&ts->lock_acquires, 1);
+  }
+  StatsRecord(QUEUE_STAT_LOCK_WAIT, wait);
+  q->locked_at = StatsNow();
+}
 
-    free(node);
-    node = NULL;
-    mtx_unlock(&queue.mtx);
+/**
+ * @brief Record the hold time of the lock that is about to be released
+ */
+static inline void StatsUnlock(Queue *q) {
+  StatsRecord(QUEUE_STAT_LOCK_HOLD, StatsNow() - q->locked_at);
+}
 
-    return item;
-  } else {
-    cnd_t *cv = malloc(sizeof(cnd_t));
-    cnd_init(cv);
+#define STATS_STAMP(field) ((field) = StatsNow())
+#define STATS_SINCE(id, field) StatsRecord((id), StatsNow() - (field))
 
-    // Enqueue the conditional variable into the queue
-    CvNode *cv_node = malloc(sizeof(CvNode));
-    cv_node->cv = cv;
-    cv_node->next = NULL;
+#else
 
-    if (cvQueue.head == NULL) {
-      cvQueue.head = cv_node;
-      cvQueue.tail = cv_node;
+static inline uint64_t StatsNow(void) {
+  return 0;
+}
+
+static inline void StatsRecord(QueueStatId id, uint64_t ns) {
+  (void)id;
+  (void)ns;
+}
+
+static inline void StatsUnlock(Queue *q) {
+  (void)q;
+}
+
+#define STATS_STAMP(field) ((void)0)
+#define STATS_SINCE(id, field) ((void)0)
+
+#endif
+
+/* -------------------Locking and Counters ----------------*/
+
+/**
+ * @brief Open a counters write section; the caller has just taken the lock
+ */
+static inline void QueueLockCounters(Queue *q) {
+  size_t seq = atomic_load_explicit(&q->counters.seq, memory_order_relaxed);
+  atomic_store_explicit(&q->counters.seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * @brief Close the counters write section; the caller is about to unlock
+ */
+static inline void QueueUnlockCounters(Queue *q) {
+  size_t seq = atomic_load_explicit(&q->counters.seq, memory_order_relaxed);
+  atomic_store_explicit(&q->counters.seq, seq + 1, memory_order_release);
+}
+
+/*
+ * Callbacks of served dequeueAsync() records run on the thread that served
+ * them, right after it drops the lock. A callback that dequeues again may
+ * complete another record at once; that one is queued on the thread and run
+ * by the outermost call, so the stack does not grow with the queue length.
+ */
+static _Thread_local CvAsync *asyncHead;
+static _Thread_local CvAsync *asyncTail;
+static _Thread_local bool asyncRunning;
+
+/**
+ * @brief Run the callbacks of completed dequeueAsync() records, oldest first
+ *
+ * Each goes through its queue's executor, or is called right here without one.
+ */
+static void AsyncRun(CvAsync *done, CvAsync *done_tail) {
+  if (asyncHead == NULL) {
+    asyncHead = done;
+  } else {
+    asyncTail->next = done;
+  }
+  asyncTail = done_tail;
+  if (asyncRunning) {
+    return;
+  }
+
+  asyncRunning = true;
+  while (asyncHead != NULL) {
+    CvAsync *record = asyncHead;
+    asyncHead = record->next;
+    void *item = record->node.taken > 0 ? record->item : NULL;
+    QueueAsyncFn fn = record->fn;
+    void *ctx = record->ctx;
+    Queue *q = record->queue;
+    free(record);
+    if (q->executor != NULL) {
+      q->executor(fn, item, ctx, q->executor_ctx);
     } else {
-      cvQueue.tail->next = cv_node;
-      cvQueue.tail = cv_node;
+      fn(item, ctx);
     }
+  }
+  asyncTail = NULL;
+  asyncRunning = false;
+}
+
+/**
+ * @brief Take the queue lock
+ */
+static void QueueLock(Queue *q) {
+#ifdef QUEUE_STATS
+  StatsLock(q);
+#else
+  mtx_lock(&q->mtx);
+#endif
+  QueueLockCounters(q);
+}
 
-    queue.wait_count++;
-    cnd_wait(cv, &queue.mtx);  // Wait for signal
+/**
+ * @brief Release the queue lock
+ *
+ * Then hands the items that expired while it was held to the reclaim
+ * callback, and runs the callbacks of the dequeueAsync() records served.
+ */
+static void QueueUnlock(Queue *q) {
+  CvAsync *done = q->completed;
+  CvAsync *done_tail = q->completed_tail;
+  q->completed = NULL;
+  q->completed_tail = NULL;
 
+  void **expired = NULL;
+  size_t expired_count = q->expired_count;
+  QueueDrainFn reclaim = NULL;
+  void *reclaim_ctx = NULL;
+  if (expired_count > 0) {
+    expired = q->expired;
+    reclaim = q->reclaim;
+    reclaim_ctx = q->reclaim_ctx;
+    q->expired = NULL;
+    q->expired_count = 0;
+    q->expired_cap = 0;
   }
 
-  // Dequeue from the data queue
-  Node *node = queue.head;
-  void *item = node->data;
-  queue.head = node->next;
-  queue.item_count--;
+  StatsUnlock(q);
+  QueueUnlockCounters(q);
+  mtx_unlock(&q->mtx);
 
-  if (queue.item_count == 0) {  // If the queue is empty
-    queue.tail = NULL;
+  if (expired_count > 0) {
+    reclaim(expired, expired_count, reclaim_ctx);
+    free(expired);
   }
+  if (done != NULL) {
+    AsyncRun(done, done_tail);
+  }
+}
 
-  // Dequeue from the conditional variables queue
-  CvNode *cv_node = cvQueue.head;
-  cnd_t *cv = cv_node->cv;
-  cvQueue.head = cv_node->next;
-  queue.wait_count--;
+/**
+ * @brief cnd_wait() on a condvar tied to the queue lock
+ *
+ * With expired items set aside, it only cycles the lock so the reclaim
+ * callback runs before the thread sleeps; callers re-check their condition
+ * as after a spurious wakeup.
+ */
+static void QueueWait(Queue *q, cnd_t *cv) {
+  if (q->expired_count > 0) {
+    QueueUnlock(q);
+    QueueLock(q);
+    return;
+  }
+  q->parked++;
+  StatsUnlock(q);
+  QueueUnlockCounters(q);
+  uint64_t start = StatsNow();
+  cnd_wait(cv, &q->mtx);
+  STATS_STAMP(q->locked_at);
+  StatsRecord(QUEUE_STAT_PARK, StatsNow() - start);
+  QueueLockCounters(q);
+  q->parked--;
+}
 
-  if (queue.wait_count > 0) {
-    cnd_signal(cvQueue.head->cv);
+/**
+ * @brief cnd_timedwait() on a condvar tied to the queue lock
+ *
+ * Cycles the lock instead while expired items are set aside, see QueueWait().
+ * @return The cnd_timedwait() result
+ */
+static int QueueTimedWait(Queue *q, cnd_t *cv, const struct timespec *deadline) {
+  if (q->expired_count > 0) {
+    QueueUnlock(q);
+    QueueLock(q);
+    return thrd_success;
   }
+  q->parked++;
+  StatsUnlock(q);
+  QueueUnlockCounters(q);
+  uint64_t start = StatsNow();
+  int result = cnd_timedwait(cv, &q->mtx, deadline);
+  STATS_STAMP(q->locked_at);
+  StatsRecord(QUEUE_STAT_PARK, StatsNow() - start);
+  QueueLockCounters(q);
+  q->parked--;
+  return result;
+}
 
-  cnd_destroy(cv);
-  free(cv_node);
-  free(node);
-  mtx_unlock(&queue.mtx);
+/**
+ * @brief Read a counter; safe without the lock
+ */
+static inline size_t CounterGet(atomic_size_t *counter) {
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
 
-  return item;
+/**
+ * @brief Add to a counter; the caller holds the queue lock
+ */
+static inline void CounterAdd(atomic_size_t *counter, size_t n) {
+  atomic_store_explicit(counter, CounterGet(counter) + n, memory_order_relaxed);
 }
 
 /**
- * @brief Try to dequeue an item from the data queue
- * @param item Pointer to store the dequeued item
- * @return True if an item was dequeued successfully, false otherwise
+ * @brief Subtract from a counter; the caller holds the queue lock
  */
-bool tryDequeue(void **item) {
-  mtx_lock(&queue.mtx);
+static inline void CounterSub(atomic_size_t *counter, size_t n) {
+  atomic_store_explicit(counter, CounterGet(counter) - n, memory_order_relaxed);
+}
 
-  if (queue.item_count == 0) {  // If the queue is empty
-    mtx_unlock(&queue.mtx);
-    return false;
+/**
+ * @brief Check if q was closed; safe without the lock
+ */
+static inline bool IsClosed(Queue *q) {
+  return atomic_load_explicit(&q->closed, memory_order_acquire);
+}
+
+/* -------------------Lock-Free Ring ----------------*/
+
+/*
+ * SPSC mode shares everything but the ring itself with lock-free mode: the
+ * same fast paths, and the same mutex-only-to-sleep protocol for parking
+ * consumers and producers. LfPush()/LfPop() pick the ring.
+ */
+
+/**
+ * @brief Check if q runs on a lock-free ring, MPMC or SPSC
+ */
+static inline bool IsLockFreeMode(Queue *q) {
+  return q->mode == QUEUE_MODE_LOCKFREE || q->mode == QUEUE_MODE_SPSC;
+}
+
+/**
+ * @brief Check if q holds payload copies; the pointer calls reject it
+ */
+static inline bool IsPersistentMode(Queue *q) {
+  return q->mode == QUEUE_MODE_PERSISTENT;
+}
+
+/**
+ * @brief Count the stored items, expired ones included; never locks
+ */
+static size_t ItemCount(Queue *q) {
+  if (IsLockFreeMode(q)) {
+    // Slots claimed by producers but not yet by consumers; a claim in
+    // flight can make dequeue_pos briefly overtake our read of enqueue_pos
+    size_t out = atomic_load_explicit(&q->dequeue_pos, memory_order_acquire);
+    size_t in = atomic_load_explicit(&q->enqueue_pos, memory_order_acquire);
+    return in > out ? in - out : 0;
   }
+  return atomic_load_explicit(&q->counters.item_count, memory_order_acquire);
+}
 
-  // Dequeue from the data queue
-  Node *node = queue.head;
-  *item = node->data;
-  queue.head = node->next;
-  queue.item_count--;
+/**
+ * @brief Push onto the SPSC ring; only ever called by the single producer
+ *
+ * The producer re-reads dequeue_pos only when its cached copy says the ring
+ * is full, so in the steady state it touches no consumer cache line.
+ * @return True on success, false if the ring is full
+ */
+static bool SpscPush(Queue *q, void *item) {
+  size_t tail = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
 
-  if (queue.item_count == 0) {  // If the queue is empty
-    queue.tail = NULL;
+  if (tail - q->head_cache > q->mask) {
+    q->head_cache = atomic_load_explicit(&q->dequeue_pos, memory_order_acquire);
+    if (tail - q->head_cache > q->mask) {
+      return false;
+    }
   }
+  q->ring[tail & q->mask] = item;
+  STATS_STAMP(q->ring_stamps[tail & q->mask]);
+  atomic_store_explicit(&q->enqueue_pos, tail + 1, memory_order_release);
+  return true;
+}
 
-  free(node);
-  mtx_unlock(&queue.mtx);
+/**
+ * @brief Pop from the SPSC ring
+ *
+ * Called by the consumer, or under the lock on its behalf while it sleeps,
+ * never both at once. Re-reads enqueue_pos only when the cached copy says
+ * the ring is empty.
+ * @return True on success, false if the ring is empty
+ */
+static bool SpscPop(Queue *q, void **item) {
+  size_t head = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
 
+  if (head == q->tail_cache) {
+    q->tail_cache = atomic_load_explicit(&q->enqueue_pos, memory_order_acquire);
+    if (head == q->tail_cache) {
+      return false;
+    }
+  }
+  *item = q->ring[head & q->mask];
+  STATS_SINCE(QUEUE_STAT_SOJOURN, q->ring_stamps[head & q->mask]);
+  atomic_store_explicit(&q->dequeue_pos, head + 1, memory_order_release);
   return true;
 }
 
 /**
- * @brief Get the number of items in the data queue
- * @return The number of items in the queue
+ * @brief Push an item onto the lock-free ring without taking any lock
+ * @return True on success, false if the ring is full
  */
-size_t size(void) {
-  return queue.item_count;
+static bool LfPush(Queue *q, void *item) {
+  if (q->mode == QUEUE_MODE_SPSC) {
+    return SpscPush(q, item);
+  }
+
+  size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+
+  for (;;) {
+    LfSlot *slot = &q->slots[pos & q->mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        slot->item = item;
+        STATS_STAMP(slot->stamp);
+        atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {  // The slot still holds an item from the last lap
+      return false;
+    } else {  // Another producer claimed pos first
+      pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    }
+  }
 }
 
 /**
- * @brief Get the number of threads waiting on the queue
- * @return The number of waiting threads
+ * @brief Pop the oldest item from the lock-free ring without taking any lock
+ *
+ * With keep > 0 the pop only succeeds while more than keep items are left
+ * behind it. Non-blocking consumers pass the number of sleeping consumers,
+ * so every sleeper keeps a ticket on one of the items producers will hand
+ * it under the lock. The check is redone on every claim attempt, so
+ * concurrent pops cannot eat into the reservation together.
+ * @param keep Items to leave in the ring for others
+ * @return True on success, false if the ring is empty or holds only
+ *         reserved items
  */
-size_t waiting(void) {
-  return queue.wait_count;
+static bool LfPop(Queue *q, void **item, size_t keep) {
+  if (q->mode == QUEUE_MODE_SPSC) {
+    return SpscPop(q, item);  // No other consumer to keep items from
+  }
+
+  size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+
+  for (;;) {
+    LfSlot *slot = &q->slots[pos & q->mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+    if (diff == 0) {
+      if (keep > 0 &&
+          atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed) - pos <= keep) {
+        return false;
+      }
+      if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        *item = slot->item;
+        STATS_SINCE(QUEUE_STAT_SOJOURN, slot->stamp);
+        atomic_store_explicit(&slot->seq, pos + q->mask + 1,
+                              memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {  // Nothing published at pos yet
+      return false;
+    } else {  // Another consumer took pos first
+      pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+/* -------------------Notification ----------------*/
+
+/*
+ * An optional eventfd (a pipe where there is none) that is readable whenever
+ * the queue may hold items, so a reactor can wait for it next to its
+ * sockets. notify_raised mirrors the fd state and keeps the syscalls to the
+ * empty/non-empty transitions. Locked modes raise and clear it under the
+ * lock. Lock-free producers raise it after publishing, and consumers clear it
+ * when they see the ring empty and then look again, the same Dekker pairing
+ * as with wait_count.
+ */
+
+/**
+ * @brief Make the notification fd readable unless it already is
+ */
+static void NotifyRaise(Queue *q) {
+  if (q->notify_fd < 0 ||
+      atomic_load_explicit(&q->notify_raised, memory_order_relaxed) ||
+      atomic_exchange(&q->notify_raised, true)) {
+    return;
+  }
+#ifdef __linux__
+  uint64_t one = 1;
+  (void)!write(q->notify_wfd, &one, sizeof(one));
+#else
+  char one = 1;
+  (void)!write(q->notify_wfd, &one, sizeof(one));
+#endif
 }
 
 /**
- * @brief Get the number of times the queue has been visited
- * @return The number of visits to the queue
+ * @brief Reset the notification fd after a consumer found the queue empty
+ *
+ * A closed queue stays readable, so the reactor gets to see the close.
  */
-size_t visited(void) {
-  return queue.visited_count;
+static void NotifyClear(Queue *q) {
+  if (q->notify_fd < 0 || IsClosed(q) ||
+      !atomic_load_explicit(&q->notify_raised, memory_order_relaxed)) {
+    return;
+  }
+  atomic_store(&q->notify_raised, false);
+#ifdef __linux__
+  uint64_t count;
+  (void)!read(q->notify_fd, &count, sizeof(count));
+#else
+  char buf[16];
+  while (read(q->notify_fd, buf, sizeof(buf)) > 0) {
+  }
+#endif
+  // An item published while we were clearing must not go unannounced
+  atomic_thread_fence(memory_order_seq_cst);
+  if (ItemCount(q) > 0) {
+    NotifyRaise(q);
+  }
+}
+
+/**
+ * @brief Create the notification fd of q, both ends non-blocking
+ * @return True on success
+ */
+static bool NotifyOpen(Queue *q) {
+#ifdef __linux__
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  q->notify_wfd = fd;
+#else
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return false;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  int fd = fds[0];
+  q->notify_wfd = fds[1];
+#endif
+  atomic_store(&q->notify_raised, false);
+  q->notify_fd = fd;
+  return true;
+}
+
+/**
+ * @brief Close the notification fd of q, if it has one
+ */
+static void NotifyFinalize(Queue *q) {
+  if (q->notify_fd < 0) {
+    return;
+  }
+  if (q->notify_wfd != q->notify_fd) {
+    close(q->notify_wfd);
+  }
+  close(q->notify_fd);
+  q->notify_fd = -1;
+  q->notify_wfd = -1;
+}
+
+/* -------------------Data Store ----------------*/
+
+/*
+ * The data store holds the queued items: a linked list of pooled nodes in
+ * list mode, a ring of item pointers in ring mode. Callers hold q->mtx;
+ * item_count is the single source of truth for emptiness in both modes.
+ * Lock-free mode bypasses the store on its fast paths and only goes through
+ * StorePopMany(q) once a consumer has taken the lock to sleep.
+ */
+
+/**
+ * @brief Check if the data store cannot take another item
+ * @return True if the ring is full, always false in list mode
+ */
+static bool IsQueueFull(Queue *q) {
+  return q->mode == QUEUE_MODE_RING && CounterGet(&q->counters.item_count) > q->mask;
+}
+
+/**
+ * @brief Link a filled-in node onto the tail of the list
+ */
+static void ListAppend(Queue *q, Node *node) {
+  node->next = NULL;
+  node->deadline = 0;
+  STATS_STAMP(node->stamp);
+
+  if (q->tail == NULL) {
+    q->head = node;
+  } else {
+    q->tail->next = node;
+  }
+  q->tail = node;
+}
+
+/**
+ * @brief Give a node back after its item was removed from the list
+ *
+ * Intrusive links belong to the caller's object and are left alone.
+ */
+static void NodeRelease(Queue *q, Node *node) {
+  if (!IsLinkNode(node)) {
+    PoolFree(&q->pool, node);
+  }
+}
+
+/**
+ * @brief Append an item to the data store; it must not be full
+ * @return True on success, false if no node could be allocated
+ */
+static bool StorePush(Queue *q, void *item) {
+  if (q->mode == QUEUE_MODE_RING) {
+    q->ring[q->ring_tail & q->mask] = item;
+    STATS_STAMP(q->ring_stamps[q->ring_tail & q->mask]);
+    q->ring_tail++;
+  } else {
+    Node *node = PoolAlloc(&q->pool);
+    if (node == NULL) {
+      return false;
+    }
+    node->data = item;
+    ListAppend(q, node);
+  }
+
+  CounterAdd(&q->counters.item_count, 1);
+  CounterAdd(&q->counters.visited_count, 1);
+  NotifyRaise(q);
+  return true;
+}
+
+/**
+ * @brief Attach a deadline to the item StorePush() just appended
+ * @return False if the ring's deadline array could not be allocated
+ */
+static bool StoreSetDeadline(Queue *q, uint64_t deadline) {
+  if (q->mode == QUEUE_MODE_RING) {
+    if (q->ring_deadlines == NULL) {
+      q->ring_deadlines = calloc(q->mask + 1, sizeof(uint64_t));
+      if (q->ring_deadlines == NULL) {
+        return false;
+      }
+    }
+    q->ring_deadlines[(q->ring_tail - 1) & q->mask] = deadline;
+  } else {
+    q->tail->deadline = deadline;
+  }
+  CounterAdd(&q->deadline_items, 1);
+  return true;
+}
+
+/**
+ * @brief Append a caller-owned link to the list of the data store
+ *
+ * The link stands in for a pool node, so nothing is allocated.
+ */
+static void StorePushLink(Queue *q, QueueLink *link) {
+  Node *node = LinkNode(link);
+  node->data = link;
+  ListAppend(q, node);
+
+  CounterAdd(&q->counters.item_count, 1);
+  CounterAdd(&q->counters.visited_count, 1);
+  NotifyRaise(q);
+}
+
+/**
+ * @brief Append an item to its priority level of the data store
+ *
+ * Level 0 is the plain FIFO list, so only urgent items pay for the buckets.
+ * Bounded modes have a single level and keep strict FIFO order.
+ * @param prio Priority, clamped to [0, QUEUE_PRIORITY_MAX]
+ * @return True on success, false if no node could be allocated
+ */
+static bool StorePushPriority(Queue *q, void *item, int prio) {
+  if (prio <= 0 || q->mode != QUEUE_MODE_LIST) {
+    return StorePush(q, item);
+  }
+  size_t level = prio < QUEUE_PRIORITY_MAX ? (size_t)prio - 1 : QUEUE_PRIORITY_MAX - 1;
+
+  Node *node = PoolAlloc(&q->pool);
+  if (node == NULL) {
+    return false;
+  }
+  node->data = item;
+  node->next = NULL;
+  node->deadline = 0;
+  STATS_STAMP(node->stamp);
+
+  if (q->prio_tail[level] == NULL) {
+    q->prio_head[level] = node;
+    q->prio_levels |= 1u << level;
+  } else {
+    q->prio_tail[level]->next = node;
+  }
+  q->prio_tail[level] = node;
+
+  CounterAdd(&q->counters.item_count, 1);
+  CounterAdd(&q->counters.visited_count, 1);
+  NotifyRaise(q);
+  return true;
+}
+
+/**
+ * @brief Unlink the oldest node of the highest non-empty priority level
+ */
+static Node *PrioPopNode(Queue *q) {
+  size_t level = QUEUE_PRIORITY_MAX - 1;
+  while ((q->prio_levels & (1u << level)) == 0) {
+    level--;
+  }
+
+  Node *node = q->prio_head[level];
+  q->prio_head[level] = node->next;
+  if (node->next == NULL) {
+    q->prio_tail[level] = NULL;
+    q->prio_levels &= ~(1u << level);
+  }
+  return node;
+}
+
+/**
+ * @brief Move items of parked producers into free ring slots, oldest first
+ *
+ * Each producer is unlinked and woken once all of its items are stored.
+ */
+static void ServeProducers(Queue *q) {
+  while (q->producers.head != NULL && !IsQueueFull(q)) {
+    PwNode *producer = q->producers.head;
+    while (producer->stored < producer->count && !IsQueueFull(q)) {
+      StorePush(q, producer->items[producer->stored++]);
+    }
+    if (producer->deadline != 0) {
+      StoreSetDeadline(q, producer->deadline);
+    }
+    if (producer->stored < producer->count) {
+      break;
+    }
+
+    q->producers.head = producer->next;
+    if (q->producers.head == NULL) {
+      q->producers.tail = NULL;
+    }
+    cnd_signal(&producer->cv);
+  }
+}
+
+/**
+ * @brief Remove the next item from the data store; it must not be empty
+ *
+ * That is the oldest item of the highest priority level holding any, expired
+ * or not; StorePop() skips the expired ones.
+ * @return The removed item
+ */
+static void *StoreTake(Queue *q) {
+  void *item;
+  uint64_t deadline;
+
+  if (q->mode == QUEUE_MODE_RING) {
+    size_t slot = q->ring_head & q->mask;
+    item = q->ring[slot];
+    // Pushes never write the deadline, so every free slot is left at 0
+    deadline = q->ring_deadlines != NULL ? q->ring_deadlines[slot] : 0;
+    if (deadline != 0) {
+      q->ring_deadlines[slot] = 0;
+    }
+    STATS_SINCE(QUEUE_STAT_SOJOURN, q->ring_stamps[slot]);
+    q->ring_head++;
+  } else if (q->prio_levels != 0) {
+    Node *node = PrioPopNode(q);
+    item = node->data;
+    deadline = node->deadline;
+    STATS_SINCE(QUEUE_STAT_SOJOURN, node->stamp);
+    NodeRelease(q, node);
+  } else {
+    Node *node = q->head;
+    item = node->data;
+    deadline = node->deadline;
+    STATS_SINCE(QUEUE_STAT_SOJOURN, node->stamp);
+    q->head = node->next;
+    if (q->head == NULL) {
+      q->tail = NULL;
+    }
+    NodeRelease(q, node);
+  }
+
+  if (deadline != 0) {
+    CounterSub(&q->deadline_items, 1);
+  }
+  CounterSub(&q->counters.item_count, 1);
+  // The slot just opened up goes to the oldest producer blocked on a full ring
+  if (q->producers.head != NULL) {
+    ServeProducers(q);
+  }
+  if (CounterGet(&q->counters.item_count) == 0) {
+    NotifyClear(q);
+  }
+  return item;
+}
+
+/* -------------------Item Deadlines ----------------*/
+
+#define EXPIRE_MIN_CAP 64  // First capacity of the expired items buffer
+
+/**
+ * @brief Convert an absolute TIME_UTC timestamp to nanoseconds
+ * @return The timestamp, 0 for times before the epoch
+ */
+static uint64_t TimespecNs(const struct timespec *ts) {
+  if (ts->tv_sec < 0) {
+    return 0;
+  }
+  return (uint64_t)ts->tv_sec * 1000000000u + (uint64_t)ts->tv_nsec;
+}
+
+static uint64_t UtcNowNs(void) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return TimespecNs(&now);
+}
+
+/**
+ * @brief Get the deadline of the item StoreTake() would return next
+ * @return The deadline, 0 if it has none or the store is empty
+ */
+static uint64_t StoreNextDeadline(Queue *q) {
+  if (CounterGet(&q->counters.item_count) == 0) {
+    return 0;
+  }
+  if (q->mode == QUEUE_MODE_RING) {
+    return q->ring_deadlines != NULL ? q->ring_deadlines[q->ring_head & q->mask] : 0;
+  }
+  if (q->prio_levels != 0) {
+    size_t level = QUEUE_PRIORITY_MAX - 1;
+    while ((q->prio_levels & (1u << level)) == 0) {
+      level--;
+    }
+    return q->prio_head[level]->deadline;
+  }
+  return q->head->deadline;
+}
+
+/**
+ * @brief Set an expired item aside for the reclaim callback, if one is set
+ *
+ * The callback gets it once the lock is released, see QueueUnlock(). Should
+ * the buffer not grow, the item is dropped.
+ */
+static void ExpireItem(Queue *q, void *item) {
+  if (q->reclaim == NULL) {
+    return;
+  }
+  if (q->expired_count == q->expired_cap) {
+    size_t cap = q->expired_cap > 0 ? 2 * q->expired_cap : EXPIRE_MIN_CAP;
+    void **expired = realloc(q->expired, cap * sizeof(void *));
+    if (expired == NULL) {
+      return;
+    }
+    q->expired = expired;
+    q->expired_cap = cap;
+  }
+  q->expired[q->expired_count++] = item;
+}
+
+/**
+ * @brief Drop the expired items at the front of the data store
+ *
+ * Expiry is lazy: an item is only checked once it is next in line. Costs one
+ * counter read while no stored item has a deadline, and reads the clock only
+ * while the next item has one.
+ */
+static void StoreExpire(Queue *q) {
+  if (CounterGet(&q->deadline_items) == 0) {
+    return;
+  }
+
+  uint64_t deadline = StoreNextDeadline(q);
+  if (deadline == 0) {
+    return;
+  }
+  uint64_t now = UtcNowNs();
+  while (deadline != 0 && deadline <= now) {
+    ExpireItem(q, StoreTake(q));
+    deadline = StoreNextDeadline(q);
+  }
+}
+
+/**
+ * @brief Remove the next item that has not expired from the data store
+ *
+ * Every pop under the lock goes through here, so consumers never get an
+ * expired item, wherever it was queued.
+ * @param item Receives the removed item
+ * @return True if an item was removed, false if the store held no live one
+ */
+static bool StorePop(Queue *q, void **item) {
+  StoreExpire(q);
+  if (CounterGet(&q->counters.item_count) == 0) {
+    return false;
+  }
+  *item = StoreTake(q);
+  return true;
+}
+
+/**
+ * @brief Count the expired items still queued behind live ones
+ *
+ * Walks the store until it has seen every item with a deadline.
+ */
+static size_t StoreCountExpired(Queue *q, uint64_t now) {
+  size_t left = CounterGet(&q->deadline_items);
+  size_t expired = 0;
+
+  if (q->mode == QUEUE_MODE_RING) {
+    for (size_t pos = q->ring_head; left > 0 && pos != q->ring_tail; pos++) {
+      uint64_t deadline = q->ring_deadlines[pos & q->mask];
+      if (deadline != 0) {
+        left--;
+        expired += deadline <= now;
+      }
+    }
+    return expired;
+  }
+
+  for (size_t level = 0; left > 0 && level <= QUEUE_PRIORITY_MAX; level++) {
+    Node *node = level == 0 ? q->head
+                 : (q->prio_levels & (1u << (level - 1))) != 0 ? q->prio_head[level - 1]
+                 : NULL;
+    for (; left > 0 && node != NULL; node = node->next) {
+      if (node->deadline != 0) {
+        left--;
+        expired += node->deadline <= now;
+      }
+    }
+  }
+  return expired;
+}
+
+/**
+ * @brief Count the live items of the data store
+ *
+ * Expired items at the front are popped for the reclaim callback, which runs
+ * once the lock is released; those further back are only left out of the
+ * count. Costs a walk of the store while items with a deadline are queued.
+ */
+static size_t StoreLiveCount(Queue *q) {
+  StoreExpire(q);
+  if (CounterGet(&q->deadline_items) == 0) {
+    return ItemCount(q);
+  }
+  return ItemCount(q) - StoreCountExpired(q, UtcNowNs());
+}
+
+/**
+ * @brief Append up to count items to the data store in one pass
+ *
+ * List mode links the new nodes into a private chain and splices it onto the
+ * tail once; ring mode copies as many items as there are free slots.
+ * @return The number of items stored
+ */
+static size_t StorePushMany(Queue *q, void **items, size_t count) {
+  size_t stored = 0;
+
+  if (q->mode == QUEUE_MODE_RING) {
+    size_t room = q->mask + 1 - CounterGet(&q->counters.item_count);
+    stored = count < room ? count : room;
+    for (size_t i = 0; i < stored; i++) {
+      q->ring[(q->ring_tail + i) & q->mask] = items[i];
+      STATS_STAMP(q->ring_stamps[(q->ring_tail + i) & q->mask]);
+    }
+    q->ring_tail += stored;
+  } else {
+    Node *first = NULL;
+    Node *last = NULL;
+    for (; stored < count; stored++) {
+      Node *node = PoolAlloc(&q->pool);
+      if (node == NULL) {
+        break;
+      }
+      node->data = items[stored];
+      node->next = NULL;
+      node->deadline = 0;
+      STATS_STAMP(node->stamp);
+      if (last == NULL) {
+        first = node;
+      } else {
+        last->next = node;
+      }
+      last = node;
+    }
+
+    if (first != NULL) {
+      if (q->tail == NULL) {
+        q->head = first;
+      } else {
+        q->tail->next = first;
+      }
+      q->tail = last;
+    }
+  }
+
+  CounterAdd(&q->counters.item_count, stored);
+  CounterAdd(&q->counters.visited_count, stored);
+  if (stored > 0) {
+    NotifyRaise(q);
+  }
+  return stored;
+}
+
+/**
+ * @brief Remove up to max of the oldest items from the data store
+ * @return The number of items removed
+ */
+static size_t StorePopMany(Queue *q, void **items, size_t max) {
+  size_t taken = 0;
+
+  if (IsLockFreeMode(q)) {
+    while (taken < max && LfPop(q, &items[taken], 0)) {
+      taken++;
+    }
+    if (taken > 0 && atomic_load(&q->space_waiters) > 0) {
+      cnd_broadcast(&q->space_cv);
+    }
+    return taken;
+  }
+
+  while (taken < max && StorePop(q, &items[taken])) {
+    taken++;
+  }
+  return taken;
+}
+
+/* -------------------Spinning ----------------*/
+
+/*
+ * A consumer that finds the queue empty first polls it for a bounded number
+ * of rounds with exponential backoff before it parks. The budget adapts per
+ * queue: it grows when spinning pays off or a park turns out to be short,
+ * and shrinks when parks are long, so an idle queue soon stops burning CPU.
+ * Producers facing a full ring poll for a free slot on the same budget.
+ */
+#define SPIN_DEFAULT_LIMIT 4096   // Pause units per dequeue, at most
+#define SPIN_MIN_BUDGET 64        // Budget never adapts below this
+#define SPIN_PAUSE_MAX 64         // Longest backoff step before yielding
+#define SPIN_SHORT_PARK_NS 50000  // Parks shorter than this were worth a spin
+
+/**
+ * @brief Tell the CPU we are in a spin-wait loop
+ */
+static inline void CpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#else
+  atomic_signal_fence(memory_order_seq_cst);
+#endif
+}
+
+/**
+ * @brief Check without the lock whether the store looks non-empty
+ *
+ * Only a hint: the answer can be stale by the time the caller acts on it.
+ */
+static bool StoreMayHaveItems(Queue *q) {
+  if (q->mode == QUEUE_MODE_SPSC) {
+    return atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed) !=
+           atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+  }
+  if (IsLockFreeMode(q)) {
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    LfSlot *slot = &q->slots[pos & q->mask];
+    return atomic_load_explicit(&slot->seq, memory_order_relaxed) == pos + 1;
+  }
+  return CounterGet(&q->counters.item_count) > 0;
+}
+
+/**
+ * @brief Grow or shrink the spin budget within [SPIN_MIN_BUDGET, spin_limit]
+ */
+static void SpinAdapt(Queue *q, bool grow) {
+  size_t limit = atomic_load_explicit(&q->spin_limit, memory_order_relaxed);
+  size_t budget = atomic_load_explicit(&q->spin_budget, memory_order_relaxed);
+  size_t floor = limit < SPIN_MIN_BUDGET ? limit : SPIN_MIN_BUDGET;
+
+  budget = grow ? budget * 2 : budget / 2;
+  if (budget > limit) {
+    budget = limit;
+  }
+  if (budget < floor) {
+    budget = floor;
+  }
+  atomic_store_explicit(&q->spin_budget, budget, memory_order_relaxed);
+}
+
+/**
+ * @brief Check without the lock whether a producer could store right away
+ *
+ * Only a hint, like StoreMayHaveItems(); parked producers come first.
+ */
+static bool StoreMayHaveSpace(Queue *q) {
+  return !IsQueueFull(q) && atomic_load_explicit(&q->space_waiters, memory_order_relaxed) == 0;
+}
+
+/**
+ * @brief Poll ready(q) with exponential backoff for up to the spin budget
+ * @return True if ready(q) held before the budget ran out
+ */
+static bool SpinPoll(Queue *q, bool (*ready)(Queue *)) {
+  size_t budget = atomic_load_explicit(&q->spin_budget, memory_order_relaxed);
+  size_t spent = 0;
+  size_t pause = 1;
+
+  while (spent < budget) {
+    if (ready(q)) {
+      SpinAdapt(q, true);
+      return true;
+    }
+    if (pause < SPIN_PAUSE_MAX) {
+      for (size_t i = 0; i < pause; i++) {
+        CpuRelax();
+      }
+      spent += pause;
+      pause <<= 1;
+    } else {
+      thrd_yield();
+      spent += SPIN_PAUSE_MAX;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Poll for items before parking, with exponential backoff
+ *
+ * Does nothing when consumers are already asleep, since we would have to
+ * queue up behind them anyway.
+ * @return True if the store looked non-empty before the budget ran out
+ */
+static bool SpinForItems(Queue *q) {
+  if (atomic_load(&q->counters.wait_count) > 0 || IsClosed(q)) {
+    return false;
+  }
+  return SpinPoll(q, StoreMayHaveItems);
+}
+
+/**
+ * @brief Poll a full ring for a free slot before taking the lock to park
+ *
+ * Does nothing outside ring mode, when there is room already, or when other
+ * producers are parked, since we would have to queue up behind them anyway.
+ */
+static void SpinForSpace(Queue *q) {
+  if (q->mode != QUEUE_MODE_RING || !IsQueueFull(q) ||
+      atomic_load(&q->space_waiters) > 0 || IsClosed(q)) {
+    return;
+  }
+  SpinPoll(q, StoreMayHaveSpace);
+}
+
+/**
+ * @brief Nanoseconds elapsed since start, on the TIME_UTC clock
+ */
+static long long ElapsedNs(const struct timespec *start) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return (long long)(now.tv_sec - start->tv_sec) * 1000000000LL +
+         (now.tv_nsec - start->tv_nsec);
+}
+
+/* -------------------Waiters ----------------*/
+
+/**
+ * @brief Check if the conditional variables queue is empty
+ * @return True if the queue is empty, false otherwise
+ */
+static bool IsCvQueueEmpty(Queue *q) {
+  return q->waiters.head == NULL;
+}
+
+/**
+ * @brief Check if the data queue is empty
+ * @return True if the queue is empty, false otherwise
+ */
+static bool IsQueueEmpty(Queue *q) {
+  return CounterGet(&q->counters.item_count) == 0;
+}
+
+/**
+ * @brief Remove a waiter from anywhere in the conditional variables queue
+ *
+ * The others keep their relative order, so a waiter that gives up (timeout)
+ * does not disturb FIFO service of the rest.
+ */
+static void UnlinkWaiter(Queue *q, CvNode *waiter) {
+  if (waiter->prev == NULL) {
+    q->waiters.head = waiter->next;
+  } else {
+    waiter->prev->next = waiter->next;
+  }
+  if (waiter->next == NULL) {
+    q->waiters.tail = waiter->prev;
+  } else {
+    waiter->next->prev = waiter->prev;
+  }
+  waiter->queued = false;
+  atomic_fetch_sub(&q->counters.wait_count, 1);
+}
+
+/**
+ * @brief Claim the dequeueAny() group of a waiter before serving it
+ *
+ * On success the group's mutex stays locked until ReleaseWaiter().
+ * @return True if the waiter can be served, false if its group was already
+ *         served through another queue; the dead record is then unlinked
+ */
+static bool ClaimWaiter(Queue *q, CvNode *waiter) {
+  if (waiter->select == NULL) {
+    return true;
+  }
+  mtx_lock(&waiter->select->mtx);
+  if (!waiter->select->woken) {
+    return true;
+  }
+  mtx_unlock(&waiter->select->mtx);
+  UnlinkWaiter(q, waiter);
+  return false;
+}
+
+/**
+ * @brief Queue a served dequeueAsync() record for its callback
+ *
+ * The callback runs once the lock is dropped, see QueueUnlock().
+ */
+static void AsyncComplete(Queue *q, CvAsync *record) {
+  record->next = NULL;
+  if (q->completed == NULL) {
+    q->completed = record;
+  } else {
+    q->completed_tail->next = record;
+  }
+  q->completed_tail = record;
+}
+
+/**
+ * @brief Remove a claimed waiter from the queue and wake it
+ *
+ * A waiter with nothing taken is being released by queueClose().
+ */
+static void ReleaseWaiter(Queue *q, CvNode *waiter) {
+  UnlinkWaiter(q, waiter);
+  STATS_STAMP(waiter->signaled_at);
+  if (waiter->async != NULL) {
+    AsyncComplete(q, waiter->async);
+    return;
+  }
+  if (waiter->select == NULL) {
+    cnd_signal(&waiter->cv);
+    return;
+  }
+
+  CvSelect *select = waiter->select;
+  if (waiter->taken > 0) {
+    select->which = (size_t)(waiter - select->records);
+  }
+  select->woken = true;
+  cnd_signal(&select->cv);
+  mtx_unlock(&select->mtx);
+}
+
+/**
+ * @brief Hand stored items to waiters, oldest first
+ *
+ * Each waiter gets as many items as are available, up to what it asked for,
+ * is removed from the conditional variables queue and is woken on its own
+ * condvar. Nobody else is signaled, so there is no wakeup relay and no
+ * waiter ever wakes up to an empty queue.
+ */
+static void ServeWaiters(Queue *q) {
+  while (q->waiters.head != NULL) {
+    CvNode *waiter = q->waiters.head;
+    if (!ClaimWaiter(q, waiter)) {
+      continue;
+    }
+    waiter->taken = StorePopMany(q, waiter->items, waiter->max);
+    if (waiter->taken == 0) {
+      if (waiter->select != NULL) {
+        mtx_unlock(&waiter->select->mtx);
+      }
+      break;
+    }
+    ReleaseWaiter(q, waiter);
+  }
+}
+
+/**
+ * @brief Give new items straight to the oldest waiters, bypassing the store
+ *
+ * Only valid for the locked modes, where nobody waits while the store holds
+ * items, so skipping the store cannot reorder anything.
+ * @return The number of items handed over
+ */
+static size_t HandOff(Queue *q, void **items, size_t count) {
+  size_t given = 0;
+
+  while (given < count && q->waiters.head != NULL) {
+    CvNode *waiter = q->waiters.head;
+    if (!ClaimWaiter(q, waiter)) {
+      continue;
+    }
+    size_t n = count - given < waiter->max ? count - given : waiter->max;
+    for (size_t i = 0; i < n; i++) {
+      waiter->items[i] = items[given + i];
+      StatsRecord(QUEUE_STAT_SOJOURN, 0);  // Never stored
+    }
+    waiter->taken = n;
+    given += n;
+    ReleaseWaiter(q, waiter);
+  }
+
+  CounterAdd(&q->counters.visited_count, given);
+  return given;
+}
+
+/**
+ * @brief Insert an item while holding the lock
+ *
+ * A sleeping consumer gets the item directly; only otherwise is a node
+ * allocated and linked into the store.
+ * @return True if the item was delivered or stored
+ */
+static bool EnqueueLocked(Queue *q, void *item) {
+  if (HandOff(q, &item, 1) > 0) {
+    return true;
+  }
+  return StorePush(q, item);
+}
+
+/**
+ * @brief Check if a producer has to park instead of storing (never in list mode)
+ *
+ * It has to while the ring is full, and while other producers are parked so
+ * it does not overtake them.
+ */
+static bool ProducerMustWait(Queue *q) {
+  if (q->producers.head != NULL) {
+    return true;
+  }
+  // Expired items must not hold slots against producers
+  if (IsQueueFull(q)) {
+    StoreExpire(q);
+  }
+  return IsQueueFull(q);
+}
+
+/**
+ * @brief Park in the producer FIFO until consumers have stored our items
+ *
+ * Consumers fill the slots they free from the oldest parked producer, see
+ * ServeProducers(), so once woken there is nothing left to do.
+ * @param deadline Deadline of the single item, 0 for none
+ * @return The number of items stored, fewer than count only if q was closed
+ */
+static size_t ParkProducer(Queue *q, void **items, size_t count, uint64_t deadline) {
+  PwNode producer;  // Our record in the producer FIFO
+
+  cnd_init(&producer.cv);
+  producer.items = items;
+  producer.count = count;
+  producer.stored = 0;
+  producer.deadline = deadline;
+  producer.next = NULL;
+  if (q->producers.head == NULL) {
+    q->producers.head = &producer;
+  } else {
+    q->producers.tail->next = &producer;
+  }
+  q->producers.tail = &producer;
+  CounterAdd(&q->space_waiters, 1);
+
+  // queueClose() unlinks us before waking us; wakeups can be spurious
+  while (producer.stored < count && !IsClosed(q)) {
+    QueueWait(q, &producer.cv);
+  }
+
+  CounterSub(&q->space_waiters, 1);
+  cnd_destroy(&producer.cv);
+  return producer.stored;
+}
+
+/**
+ * @brief Take up to max items, joining the waiter FIFO if we have to wait
+ *
+ * Returns straight away when nobody is queued ahead of us and there are
+ * items. Otherwise a waiter record on our stack is appended to the
+ * conditional variables queue and we sleep until a producer has handed us
+ * at least one item, until the deadline passes or until the queue is closed.
+ * @param deadline Absolute TIME_UTC deadline, NULL to wait forever
+ * @return The number of items taken, 0 on timeout or if q is closed and empty
+ */
+static size_t TakeItems(Queue *q, void **items, size_t max,
+                        const struct timespec *deadline) {
+  CvNode waiter;  // Our record in the conditional variables queue
+
+  if (IsCvQueueEmpty(q)) {
+    size_t taken = StorePopMany(q, items, max);
+    if (taken > 0) {
+      return taken;
+    }
+  }
+  if (IsClosed(q)) {
+    return 0;
+  }
+
+  cnd_init(&waiter.cv);
+  waiter.items = items;
+  waiter.max = max;
+  waiter.taken = 0;
+  waiter.prev = q->waiters.tail;
+  waiter.next = NULL;
+  waiter.select = NULL;
+  waiter.async = NULL;
+
+  // Enqueue the conditional variable into the queue
+  if (q->waiters.head == NULL) {
+    q->waiters.head = &waiter;
+  } else {
+    q->waiters.tail->next = &waiter;
+  }
+  q->waiters.tail = &waiter;
+
+  // Lock-free producers check wait_count after publishing an item. Publish
+  // ourselves before looking at the ring so one of the two sides sees the
+  // other and no wakeup is lost.
+  atomic_fetch_add(&q->counters.wait_count, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (IsLockFreeMode(q)) {
+    ServeWaiters(q);
+  }
+
+  // Time the park so the spin budget can learn from it
+  struct timespec parked;
+  bool adapt = atomic_load_explicit(&q->spin_limit, memory_order_relaxed) > 0;
+  if (adapt) {
+    timespec_get(&parked, TIME_UTC);
+  }
+
+  // Wait until a producer has served us or queueClose() has released us;
+  // wakeups can be spurious
+  while (waiter.taken == 0 && !IsClosed(q)) {
+    if (deadline == NULL) {
+      QueueWait(q, &waiter.cv);
+    } else if (QueueTimedWait(q, &waiter.cv, deadline) == thrd_timedout &&
+               waiter.taken == 0 && !IsClosed(q)) {
+      // Still ours to remove: being served or released and being unlinked
+      // happen atomically
+      UnlinkWaiter(q, &waiter);
+      break;
+    }
+  }
+
+  if (waiter.taken > 0) {
+    STATS_SINCE(QUEUE_STAT_WAKE, waiter.signaled_at);
+  }
+  if (adapt) {
+    SpinAdapt(q, waiter.taken > 0 && ElapsedNs(&parked) < SPIN_SHORT_PARK_NS);
+  }
+
+  cnd_destroy(&waiter.cv);
+  return waiter.taken;
+}
+
+/**
+ * @brief Move freshly published items to sleeping consumers, if there are any
+ *
+ * Also raises the notification fd, behind the same fence.
+ */
+static void LfWakeWaiter(Queue *q) {
+  // Pairs with the fence in TakeItems() and NotifyClear()
+  atomic_thread_fence(memory_order_seq_cst);
+  NotifyRaise(q);
+  if (atomic_load_explicit(&q->counters.wait_count, memory_order_relaxed) > 0) {
+    QueueLock(q);
+    ServeWaiters(q);
+    QueueUnlock(q);
+  }
+}
+
+/**
+ * @brief Wake producers sleeping on a full ring after a lock-free pop
+ */
+static void LfWakeProducers(Queue *q) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&q->space_waiters, memory_order_relaxed) > 0) {
+    QueueLock(q);
+    cnd_broadcast(&q->space_cv);
+    QueueUnlock(q);
+  }
+}
+
+/**
+ * @brief Push onto the lock-free ring, sleeping while it is full
+ * @return True if the item was pushed, false if the queue is closed
+ */
+static bool LfEnqueue(Queue *q, void *item) {
+  if (IsClosed(q)) {
+    return false;
+  }
+  if (LfPush(q, item)) {
+    return true;
+  }
+
+  QueueLock(q);
+  // Batch producers only wake consumers once they are done; never sleep on
+  // a full ring with consumers still asleep
+  ServeWaiters(q);
+  atomic_fetch_add(&q->space_waiters, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  bool pushed;
+  while (!(pushed = LfPush(q, item)) && !IsClosed(q)) {
+    QueueWait(q, &q->space_cv);
+  }
+  atomic_fetch_sub(&q->space_waiters, 1);
+  QueueUnlock(q);
+  return pushed;
+}
+
+/* -------------------Persistent Ring ----------------*/
+
+#define PERSIST_MAGIC 0x5155455545505232ull  // "QUEUEPR2", bump on layout changes
+#define PERSIST_SYNC_BATCH 64                // Commits between automatic syncs
+
+/**
+ * @brief Get the payload slot of ring position pos
+ */
+static unsigned char *PersistSlot(Queue *q, size_t pos) {
+  return q->persist->map + q->persist->page_size + (pos & q->mask) * q->persist->item_size;
+}
+
+/**
+ * @brief Flush count slots starting at slot to the file
+ */
+static bool PersistFlush(PersistRing *pr, size_t slot, size_t count) {
+  size_t start = pr->page_size + slot * pr->item_size;
+  size_t end = start + count * pr->item_size;
+  start &= ~(pr->page_size - 1);  // msync() wants a page-aligned address
+  return msync(pr->map + start, end - start, MS_SYNC) == 0;
+}
+
+/**
+ * @brief Checksum of a commit record, FNV-1a over its three words
+ */
+static uint64_t PersistCheck(uint64_t seq, uint64_t head, uint64_t tail) {
+  uint64_t words[] = {PERSIST_MAGIC, seq, head, tail};
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+    for (int shift = 0; shift < 64; shift += 8) {
+      hash = (hash ^ ((words[i] >> shift) & 0xff)) * 0x100000001b3ull;
+    }
+  }
+  return hash;
+}
+
+/**
+ * @brief Fill in commit record r
+ */
+static void PersistWriteRecord(PersistCommitRecord *r, uint64_t seq, uint64_t head,
+                               uint64_t tail) {
+  r->seq = seq;
+  r->head = head;
+  r->tail = tail;
+  r->check = PersistCheck(seq, head, tail);
+}
+
+/**
+ * @brief Commit the current head and tail of q to its file
+ *
+ * The payloads written since the last commit reach the file before the
+ * header that covers them, and slots freed by consumers become reusable
+ * only now. Called with the lock held.
+ * @return False if the file could not be written, nothing is committed then
+ */
+static bool PersistSync(Queue *q) {
+  PersistRing *pr = q->persist;
+  size_t count = q->ring_tail - pr->synced_tail;
+  size_t first = pr->synced_tail & q->mask;
+  size_t run = count < q->mask + 1 - first ? count : q->mask + 1 - first;
+
+  if (count > 0 && (!PersistFlush(pr, first, run) ||
+                    (run < count && !PersistFlush(pr, 0, count - run)))) {
+    return false;
+  }
+
+  // The record we overwrite holds the commit before the last one
+  uint64_t seq = pr->synced_seq + 1;
+  PersistCommitRecord *record = &pr->header->commits[seq & 1];
+  PersistCommitRecord older = *record;
+  PersistWriteRecord(record, seq, q->ring_head, q->ring_tail);
+  if (msync(pr->map, pr->page_size, MS_SYNC) != 0) {
+    // The page stays dirty and may still reach the file; keep it at the
+    // last commit, which is all a false return promises
+    *record = older;
+    return false;
+  }
+  pr->synced_head = q->ring_head;
+  pr->synced_tail = q->ring_tail;
+  pr->synced_seq = seq;
+  pr->unsynced = 0;
+  return true;
+}
+
+/**
+ * @brief Count a commit, syncing once a batch of them has built up
+ */
+static void PersistCommit(Queue *q) {
+  if (++q->persist->unsynced >= PERSIST_SYNC_BATCH) {
+    PersistSync(q);
+  }
+}
+
+/**
+ * @brief Check if the ring has no slot left behind the committed head
+ */
+static bool PersistFull(Queue *q) {
+  return q->ring_tail - q->persist->synced_head > q->mask;
+}
+
+/**
+ * @brief Copy the oldest payload out of the ring; it must not be empty
+ */
+static void PersistPop(Queue *q, void *payload) {
+  memcpy(payload, PersistSlot(q, q->ring_head), q->persist->item_size);
+  q->ring_head++;
+
+  CounterSub(&q->counters.item_count, 1);
+  if (CounterGet(&q->counters.item_count) == 0) {
+    NotifyClear(q);
+  }
+  // A producer blocked on a full ring can only reuse the slot once committed
+  if (q->space_waiters > 0) {
+    if (PersistSync(q)) {
+      cnd_signal(&q->space_cv);
+    }
+  } else {
+    PersistCommit(q);
+  }
+}
+
+/**
+ * @brief Find the newest intact commit record of h
+ * @return The record, or NULL if neither is intact and fits slots
+ */
+static const PersistCommitRecord *PersistLatest(const PersistHeader *h, size_t slots) {
+  const PersistCommitRecord *latest = NULL;
+  for (size_t i = 0; i < 2; i++) {
+    const PersistCommitRecord *r = &h->commits[i];
+    if (r->check == PersistCheck(r->seq, r->head, r->tail) && r->tail - r->head <= slots &&
+        (latest == NULL || r->seq > latest->seq)) {
+      latest = r;
+    }
+  }
+  return latest;
+}
+
+/**
+ * @brief Map the queue file at path, creating it if it is empty
+ *
+ * An existing file must have been created with the same geometry; its
+ * newest intact commit becomes the head and tail of q. A file of the right
+ * size without the magic is one whose creation was cut short, and is
+ * initialized afresh.
+ * @return True on success
+ */
+static bool PersistOpen(Queue *q, const char *path, size_t slots, size_t item_size) {
+  PersistRing *pr = calloc(1, sizeof(PersistRing));
+  if (pr == NULL) {
+    return false;
+  }
+  pr->fd = -1;
+  pr->map = MAP_FAILED;
+  pr->item_size = item_size;
+  pr->page_size = (size_t)sysconf(_SC_PAGESIZE);
+  cnd_init(&pr->item_cv);
+  q->persist = pr;
+
+  if (item_size > (SIZE_MAX - pr->page_size) / slots) {
+    return false;
+  }
+  pr->map_size = pr->page_size + slots * item_size;
+
+  struct stat st;
+  pr->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (pr->fd < 0 || fstat(pr->fd, &st) != 0) {
+    return false;
+  }
+  bool fresh = st.st_size == 0;
+  if (fresh ? ftruncate(pr->fd, (off_t)pr->map_size) != 0
+            : (uint64_t)st.st_size != pr->map_size) {
+    return false;
+  }
+  pr->map = mmap(NULL, pr->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, pr->fd, 0);
+  if (pr->map == MAP_FAILED) {
+    return false;
+  }
+
+  PersistHeader *h = (PersistHeader *)pr->map;
+  if (h->magic == 0) {
+    fresh = true;
+  }
+  if (fresh) {
+    h->capacity = slots;
+    h->item_size = item_size;
+    PersistWriteRecord(&h->commits[0], 0, 0, 0);
+    memset(&h->commits[1], 0, sizeof(h->commits[1]));
+    // The magic goes last, so a crash before it leaves a file we start over
+    atomic_thread_fence(memory_order_release);
+    h->magic = PERSIST_MAGIC;
+    if (msync(pr->map, pr->page_size, MS_SYNC) != 0) {
+      return false;
+    }
+  }
+  const PersistCommitRecord *latest = PersistLatest(h, slots);
+  if (h->magic != PERSIST_MAGIC || h->capacity != slots ||
+      h->item_size != item_size || latest == NULL) {
+    return false;
+  }
+
+  pr->header = h;  // Only now is the file ours to commit to
+  q->mask = slots - 1;
+  q->ring_head = (size_t)latest->head;
+  q->ring_tail = (size_t)latest->tail;
+  pr->synced_head = q->ring_head;
+  pr->synced_tail = q->ring_tail;
+  pr->synced_seq = latest->seq;
+  atomic_store(&q->counters.item_count, q->ring_tail - q->ring_head);
+  return true;
+}
+
+/**
+ * @brief Commit what is left and unmap the file, once no thread uses q
+ */
+static void PersistClose(Queue *q) {
+  PersistRing *pr = q->persist;
+
+  if (pr->header != NULL) {
+    PersistSync(q);
+  }
+  if (pr->map != MAP_FAILED) {
+    munmap(pr->map, pr->map_size);
+  }
+  if (pr->fd >= 0) {
+    close(pr->fd);
+  }
+  cnd_destroy(&pr->item_cv);
+  free(pr);
+  q->persist = NULL;
+}
+
+/* -------------------Queue Instances ----------------*/
+
+/**
+ * @brief Reset the bookkeeping shared by every queue mode
+ */
+static void QueueInitCommon(Queue *q, QueueMode mode) {
+  q->mode = mode;
+  q->head = NULL;
+  q->tail = NULL;
+  q->ring = NULL;
+  q->mask = 0;
+  q->ring_head = 0;
+  q->ring_tail = 0;
+  q->slots = NULL;
+  q->persist = NULL;
+  atomic_init(&q->enqueue_pos, 0);
+  atomic_init(&q->dequeue_pos, 0);
+  q->head_cache = 0;
+  q->tail_cache = 0;
+  atomic_init(&q->space_waiters, 0);
+  atomic_init(&q->counters.seq, 0);
+  atomic_init(&q->counters.item_count, 0);
+  atomic_init(&q->counters.visited_count, 0);
+  atomic_init(&q->counters.wait_count, 0);
+  atomic_init(&q->spin_limit, SPIN_DEFAULT_LIMIT);
+  atomic_init(&q->spin_budget, SPIN_DEFAULT_LIMIT / 4);
+  atomic_init(&q->closed, false);
+  atomic_init(&q->notify_raised, false);
+  atomic_init(&q->deadline_items, 0);
+  q->ring_deadlines = NULL;
+  q->reclaim = NULL;
+  q->reclaim_ctx = NULL;
+  q->expired = NULL;
+  q->expired_count = 0;
+  q->expired_cap = 0;
+  q->notify_fd = -1;
+  q->notify_wfd = -1;
+  q->executor = NULL;
+  q->executor_ctx = NULL;
+  q->completed = NULL;
+  q->completed_tail = NULL;
+#ifdef QUEUE_STATS
+  q->ring_stamps = NULL;
+#endif
+  q->parked = 0;
+  q->pool.free_list = NULL;
+  q->pool.chunks = NULL;
+  q->pool.next_chunk = NODE_CHUNK_MIN;
+  q->pool.numa_node = -1;
+  q->prio_levels = 0;
+  for (size_t i = 0; i < QUEUE_PRIORITY_MAX; i++) {
+    q->prio_head[i] = NULL;
+    q->prio_tail[i] = NULL;
+  }
+  mtx_init(&q->mtx, mtx_plain);  // Initialize mutex
+  cnd_init(&q->space_cv);
+
+  // Initialize the conditional variables queue
+  q->waiters.head = NULL;
+  q->waiters.tail = NULL;
+  q->producers.head = NULL;
+  q->producers.tail = NULL;
+}
+
+/**
+ * @brief Round capacity up to a power of two
+ * @return The slot count, or 0 if there is no power of two that large
+ */
+static size_t RingSlots(size_t capacity) {
+  size_t slots = 1;
+  while (slots != 0 && slots < capacity) {
+    slots <<= 1;
+  }
+  return slots;
+}
+
+/**
+ * @brief Allocate the item ring of a ring or SPSC mode queue
+ * @return True on success, false if the ring could not be allocated
+ */
+static bool RingAlloc(Queue *q, size_t capacity) {
+  size_t slots = RingSlots(capacity);
+
+  if (slots == 0) {
+    return false;
+  }
+  q->ring = malloc(slots * sizeof(void *));
+  if (q->ring == NULL) {
+    return false;
+  }
+#ifdef QUEUE_STATS
+  q->ring_stamps = malloc(slots * sizeof(uint64_t));
+  if (q->ring_stamps == NULL) {
+    return false;
+  }
+#endif
+  q->mask = slots - 1;
+  return true;
+}
+
+/**
+ * @brief Initialize q in list mode with nodes for `reserve` items preallocated
+ * @param node NUMA node for the node slabs, validated, or -1 for any
+ */
+static void QueueInitList(Queue *q, size_t reserve, int node) {
+  QueueInitCommon(q, QUEUE_MODE_LIST);
+  q->pool.numa_node = node;
+  if (reserve > 0) {
+    PoolGrow(&q->pool, reserve);
+  }
+}
+
+/**
+ * @brief Initialize q in bounded mode, backed by a fixed ring
+ * @return True on success, false if the ring could not be allocated
+ */
+static bool QueueInitBounded(Queue *q, size_t capacity) {
+  QueueInitCommon(q, QUEUE_MODE_RING);
+  return RingAlloc(q, capacity);
+}
+
+/**
+ * @brief Initialize q in SPSC mode, backed by a fixed ring
+ * @return True on success, false if the ring could not be allocated
+ */
+static bool QueueInitSpsc(Queue *q, size_t capacity) {
+  QueueInitCommon(q, QUEUE_MODE_SPSC);
+  return RingAlloc(q, capacity);
+}
+
+/**
+ * @brief Initialize q in lock-free mode
+ * @return True on success, false if the ring could not be allocated
+ */
+static bool QueueInitLockFree(Queue *q, size_t capacity) {
+  size_t slots = RingSlots(capacity);
+
+  QueueInitCommon(q, QUEUE_MODE_LOCKFREE);
+  if (slots == 0) {
+    return false;
+  }
+  q->slots = malloc(slots * sizeof(LfSlot));
+  if (q->slots == NULL) {
+    return false;
+  }
+  for (size_t i = 0; i < slots; i++) {
+    atomic_init(&q->slots[i].seq, i);
+    q->slots[i].item = NULL;
+  }
+  q->mask = slots - 1;
+  return true;
+}
+
+/**
+ * @brief Initialize q in persistent mode, backed by the file at path
+ * @return True on success, false if the file could not be created or mapped,
+ *         or was created with a different capacity or item size
+ */
+static bool QueueInitPersistent(Queue *q, const char *path, size_t capacity,
+                                size_t item_size) {
+  size_t slots = RingSlots(capacity);
+
+  QueueInitCommon(q, QUEUE_MODE_PERSISTENT);
+  if (slots == 0 || item_size == 0) {
+    return false;
+  }
+  return PersistOpen(q, path, slots, item_size);
+}
+
+/**
+ * @brief Release everything q owns; q itself can then be reinitialized
+ *
+ * Threads still blocked in q are released by closing it first, and nothing
+ * is freed until the last of them has left the lock for good.
+ */
+static void QueueFinalize(Queue *q) {
+  queueClose(q);
+  QueueLock(q);
+  while (q->parked > 0) {
+    QueueUnlock(q);
+    thrd_yield();
+    QueueLock(q);
+  }
+  QueueUnlock(q);
+
+  // Clean up the data queue; every node lives in a pool chunk
+  PoolRelease(&q->pool);
+  if (q->persist != NULL) {
+    PersistClose(q);
+  }
+  free(q->ring);
+  free(q->slots);
+  free(q->ring_deadlines);
+  free(q->expired);
+#ifdef QUEUE_STATS
+  free(q->ring_stamps);
+  q->ring_stamps = NULL;
+#endif
+
+  NotifyFinalize(q);
+  mtx_destroy(&q->mtx);  // Destroy mutex
+  cnd_destroy(&q->space_cv);
+
+  // Waiter records belong to the waiting threads, just forget them
+  q->waiters.head = NULL;
+  q->waiters.tail = NULL;
+  q->producers.head = NULL;
+  q->producers.tail = NULL;
+
+  // Reset queue values
+  q->head = NULL;
+  q->tail = NULL;
+  q->prio_levels = 0;
+  for (size_t i = 0; i < QUEUE_PRIORITY_MAX; i++) {
+    q->prio_head[i] = NULL;
+    q->prio_tail[i] = NULL;
+  }
+  q->ring = NULL;
+  q->slots = NULL;
+  q->ring_deadlines = NULL;
+  atomic_store(&q->deadline_items, 0);
+  atomic_store(&q->counters.item_count, 0);
+  atomic_store(&q->counters.visited_count, 0);
+  atomic_store(&q->counters.wait_count, 0);
+}
+
+/**
+ * @brief Allocate a queue handle
+ * @param node NUMA node for the handle, validated, or -1 for any
+ * @return The handle, or NULL if the allocation failed
+ */
+static Queue *QueueAlloc(int node) {
+  return NumaAlloc(node, sizeof(Queue));
+}
+
+/**
+ * @brief Release a handle from QueueAlloc() once q has been finalized
+ */
+static void QueueFree(Queue *q) {
+  // The handle was allocated on the node its pool uses
+  NumaFree(q->pool.numa_node, q, sizeof(Queue));
+}
+
+/**
+ * @brief Create an unbounded queue
+ * @return The new queue, or NULL on allocation failure
+ */
+Queue *queueCreate(void) {
+  return queueCreateReserve(0);
+}
+
+/**
+ * @brief Create an unbounded queue with nodes for `reserve` items preallocated
+ * @param reserve Number of nodes to allocate up front (0 for none)
+ * @return The new queue, or NULL on allocation failure
+ */
+Queue *queueCreateReserve(size_t reserve) {
+  Queue *q = QueueAlloc(-1);
+  if (q != NULL) {
+    QueueInitList(q, reserve, -1);
+  }
+  return q;
+}
+
+/**
+ * @brief Create an unbounded queue whose handle and nodes live on a NUMA node
+ *
+ * Needs a QUEUE_NUMA build; otherwise, or if node does not exist, this is
+ * queueCreateReserve(). Items themselves are the caller's memory.
+ * @param node The NUMA node
+ * @param reserve Number of nodes to allocate up front (0 for none)
+ * @return The new queue, or NULL on allocation failure
+ */
+Queue *queueCreateOnNode(int node, size_t reserve) {
+  node = NumaNode(node);
+  Queue *q = QueueAlloc(node);
+  if (q != NULL) {
+    QueueInitList(q, reserve, node);
+  }
+  return q;
+}
+
+/**
+ * @brief Create a bounded queue, backed by a fixed ring
+ * @param capacity Maximum number of queued items, rounded up to a power of two
+ * @return The new queue, or NULL on allocation failure
+ */
+Queue *queueCreateBounded(size_t capacity) {
+  Queue *q = QueueAlloc(-1);
+  if (q != NULL && !QueueInitBounded(q, capacity)) {
+    queueDestroy(q);
+    q = NULL;
+  }
+  return q;
+}
+
+/**
+ * @brief Create a lock-free queue
+ *
+ * Producers and tryDequeue never take the mutex; dequeue only takes it to
+ * sleep when the ring is empty or other consumers are already asleep. The
+ * ring is bounded, so enqueue sleeps while it is full.
+ * @param capacity Maximum number of queued items, rounded up to a power of two
+ * @return The new queue, or NULL on allocation failure
+ */
+Queue *queueCreateLockFree(size_t capacity) {
+  Queue *q = QueueAlloc(-1);
+  if (q != NULL && !QueueInitLockFree(q, capacity)) {
+    queueDestroy(q);
+    q = NULL;
+  }
+  return q;
+}
+
+/**
+ * @brief Create a single-producer/single-consumer queue
+ *
+ * A wait-free ring with cached indices behind the usual enqueue/dequeue
+ * contract. Exactly one thread may enqueue and one other thread may dequeue
+ * at a time; the mutex is only taken when one of them has to sleep, because
+ * the ring is empty or full.
+ * @param capacity Maximum number of queued items, rounded up to a power of two
+ * @return The new queue, or NULL on allocation failure
+ */
+Queue *queueCreateSpsc(size_t capacity) {
+  Queue *q = QueueAlloc(-1);
+  if (q != NULL && !QueueInitSpsc(q, capacity)) {
+    queueDestroy(q);
+    q = NULL;
+  }
+  return q;
+}
+
+/**
+ * @brief Create a queue of fixed-size payload copies kept in a file
+ *
+ * The ring lives in a shared mapping of path, so the queued payloads survive
+ * a restart or crash: reopening the file with the same geometry resumes from
+ * the last committed head and tail, with no replay. Head and tail are
+ * committed every 64 enqueues and dequeues, when a producer needs the slots
+ * consumers freed, on queueSync() and on queueDestroy(); a crash loses the
+ * enqueues and repeats the dequeues since the last commit. Use the Copy
+ * calls to move payloads in and out; queueSize(), queueWaiting(),
+ * queueClose() and queueDestroy() work as usual. The pointer calls reject
+ * the queue: enqueues drop the item, dequeues return NULL, false or 0. The
+ * file format is that of the host and not portable.
+ * @param path File to create, or to reopen
+ * @param capacity Maximum number of queued payloads, rounded up to a power of two
+ * @param item_size Bytes per payload
+ * @return The queue, or NULL if the file could not be created or mapped, or
+ *         was created with a different capacity or item size
+ */
+Queue *queueCreatePersistent(const char *path, size_t capacity, size_t item_size) {
+  Queue *q = QueueAlloc(-1);
+  if (q != NULL && !QueueInitPersistent(q, path, capacity, item_size)) {
+    queueDestroy(q);
+    q = NULL;
+  }
+  return q;
+}
+
+/**
+ * @brief Destroy a queue created with one of the queueCreate functions
+ * @param q The queue, may be NULL
+ */
+void queueDestroy(Queue *q) {
+  if (q == NULL) {
+    return;
+  }
+  QueueFinalize(q);
+  QueueFree(q);
+}
+
+/**
+ * @brief Enqueue an item into q
+ *
+ * In bounded and lock-free mode this blocks while the ring is full. Items
+ * enqueued after queueClose() are dropped, the caller keeps ownership.
+ * @param item The item to enqueue
+ */
+void queueEnqueue(Queue *q, void *item) {
+  if (IsPersistentMode(q)) {
+    return;
+  }
+  if (IsLockFreeMode(q)) {
+    if (LfEnqueue(q, item)) {
+      LfWakeWaiter(q);
+    }
+    return;
+  }
+
+  SpinForSpace(q);
+  QueueLock(q);  // Lock the mutex because we are modifying the queue
+
+  if (!IsClosed(q)) {
+    if (ProducerMustWait(q)) {
+      ParkProducer(q, &item, 1, 0);
+    } else {
+      EnqueueLocked(q, item);
+    }
+  }
+
+  QueueUnlock(q);
+}
+
+/**
+ * @brief Enqueue an item into q ahead of all items of lower priority
+ *
+ * Items of equal priority stay FIFO, and plain queueEnqueue() is priority 0.
+ * Only list mode orders by priority, bounded and lock-free queues ignore it.
+ * Sleeping consumers are still served oldest first.
+ * @param item The item to enqueue
+ * @param prio Priority, clamped to [0, QUEUE_PRIORITY_MAX]
+ */
+void queueEnqueueWithPriority(Queue *q, void *item, int prio) {
+  if (prio <= 0 || q->mode != QUEUE_MODE_LIST) {
+    queueEnqueue(q, item);
+    return;
+  }
+
+  QueueLock(q);
+
+  // Waiters only exist while the store is empty, nothing to overtake
+  if (!IsClosed(q) && HandOff(q, &item, 1) == 0) {
+    StorePushPriority(q, item, prio);
+  }
+
+  QueueUnlock(q);
+}
+
+/**
+ * @brief Enqueue an item into q that is dropped if it is still queued at deadline
+ *
+ * Expiry is lazy: each dequeue first pops the expired items in front of the
+ * one it returns and passes them to the reclaim callback, so they are never
+ * returned to a consumer. queueSize() and queueSnapshotStats() expire them
+ * the same way and never count expired items. An item past
+ * its deadline on arrival goes straight to the callback. A sleeping consumer
+ * still gets the item directly. Only list and ring mode track deadlines;
+ * lock-free and SPSC slots have no room for one, so there this is a plain
+ * queueEnqueue().
+ * @param item The item to enqueue
+ * @param deadline Absolute TIME_UTC deadline
+ */
+void queueEnqueueWithDeadline(Queue *q, void *item, const struct timespec *deadline) {
+  if (IsPersistentMode(q)) {
+    return;
+  }
+  if (IsLockFreeMode(q)) {
+    queueEnqueue(q, item);
+    return;
+  }
+  uint64_t at = TimespecNs(deadline);
+
+  SpinForSpace(q);
+  QueueLock(q);
+
+  if (!IsClosed(q)) {
+    if (at <= UtcNowNs()) {
+      ExpireItem(q, item);
+    } else if (ProducerMustWait(q)) {
+      ParkProducer(q, &item, 1, at);
+    } else if (HandOff(q, &item, 1) == 0 && StorePush(q, item)) {
+      // Out of memory for the ring's deadlines: keep the item without one
+      StoreSetDeadline(q, at);
+    }
+  }
+
+  QueueUnlock(q);
+}
+
+/**
+ * @brief Set the callback that receives expired items of q
+ *
+ * It runs right after the lock of q is released, on the thread that found the
+ * items expired, so it may call into q; without one, expired items are
+ * simply dropped. Set it before q is shared.
+ * @param fn Called with the expired items in queue order
+ * @param ctx Passed through to fn
+ */
+void queueSetReclaim(Queue *q, QueueDrainFn fn, void *ctx) {
+  QueueLock(q);
+  q->reclaim = fn;
+  q->reclaim_ctx = ctx;
+  QueueUnlock(q);
+}
+
+#define INTRUSIVE_BATCH 64  // Links handed to waiters per HandOff() call
+
+/**
+ * @brief Enqueue a caller-owned object through the QueueLink embedded in it
+ *
+ * List mode uses the link as the queue node and never allocates. Consumers
+ * get the link pointer back from any dequeue call; QUEUE_CONTAINER_OF()
+ * recovers the object. The object must stay alive and its link untouched
+ * until it has been dequeued or drained. Ring and lock-free modes store the
+ * link pointer like any other item.
+ * @param link The link of the object to enqueue
+ */
+void queueEnqueueIntrusive(Queue *q, QueueLink *link) {
+  if (q->mode != QUEUE_MODE_LIST) {
+    queueEnqueue(q, link);
+    return;
+  }
+
+  QueueLock(q);
+
+  void *item = link;
+  if (!IsClosed(q) && HandOff(q, &item, 1) == 0) {
+    StorePushLink(q, link);
+  }
+
+  QueueUnlock(q);
+}
+
+/**
+ * @brief Enqueue a batch of caller-owned objects under one lock acquisition
+ * @param links The links of the objects to enqueue, in order
+ * @param count Number of links
+ */
+void queueEnqueueIntrusiveMany(Queue *q, QueueLink **links, size_t count) {
+  void *items[INTRUSIVE_BATCH];
+
+  if (q->mode != QUEUE_MODE_LIST) {
+    for (size_t done = 0; done < count;) {
+      size_t n = count - done < INTRUSIVE_BATCH ? count - done : INTRUSIVE_BATCH;
+      for (size_t i = 0; i < n; i++) {
+        items[i] = links[done + i];
+      }
+      queueEnqueueMany(q, items, n);
+      done += n;
+    }
+    return;
+  }
+
+  QueueLock(q);
+
+  if (!IsClosed(q)) {
+    size_t given = 0;
+    while (given < count && !IsCvQueueEmpty(q)) {
+      size_t n = count - given < INTRUSIVE_BATCH ? count - given : INTRUSIVE_BATCH;
+      for (size_t i = 0; i < n; i++) {
+        items[i] = links[given + i];
+      }
+      given += HandOff(q, items, n);
+    }
+    for (; given < count; given++) {
+      StorePushLink(q, links[given]);
+    }
+  }
+
+  QueueUnlock(q);
+}
+
+/**
+ * @brief Try to enqueue an item without blocking
+ * @param item The item to enqueue
+ * @return True if the item was enqueued, false if the queue is full or closed
+ */
+bool queueTryEnqueue(Queue *q, void *item) {
+  if (IsPersistentMode(q)) {
+    return false;
+  }
+  if (IsLockFreeMode(q)) {
+    if (IsClosed(q) || !LfPush(q, item)) {
+      return false;
+    }
+    LfWakeWaiter(q);
+    return true;
+  }
+
+  QueueLock(q);
+
+  bool stored = !IsClosed(q) && !ProducerMustWait(q) && EnqueueLocked(q, item);
+
+  QueueUnlock(q);
+  return stored;
+}
+
+/**
+ * @brief Dequeue an item from the data queue
+ * @return The dequeued item, or NULL once the queue is closed and empty
+ */
+void *queueDequeue(Queue *q) {
+  void *item;
+
+  if (!queueDequeueUntil(q, &item, NULL)) {
+    return NULL;
+  }
+  return item;
+}
+
+/**
+ * @brief Lock-free fast path for blocking dequeues in lock-free mode
+ *
+ * Only taken while no consumer is asleep ahead of us, to keep FIFO service
+ * of sleeping consumers.
+ * @return True if an item was popped
+ */
+static bool LfTryDequeueFair(Queue *q, void **item) {
+  if (!IsLockFreeMode(q) || atomic_load(&q->counters.wait_count) > 0 ||
+      !LfPop(q, item, 0)) {
+    return false;
+  }
+  LfWakeProducers(q);
+  return true;
+}
+
+/**
+ * @brief Dequeue an item, giving up at an absolute deadline
+ * @param q The queue
+ * @param item Pointer to store the dequeued item
+ * @param deadline Absolute TIME_UTC deadline, NULL to wait forever
+ * @return True if an item was dequeued, false if the deadline passed first or
+ *         the queue is closed and empty
+ */
+bool queueDequeueUntil(Queue *q, void **item, const struct timespec *deadline) {
+  if (IsPersistentMode(q)) {
+    return false;
+  }
+  if (LfTryDequeueFair(q, item)) {
+    return true;
+  }
+  if (SpinForItems(q) && LfTryDequeueFair(q, item)) {
+    return true;
+  }
+
+  QueueLock(q);
+
+  size_t taken = TakeItems(q, item, 1, deadline);
+
+  QueueUnlock(q);
+
+  return taken > 0;
+}
+
+/**
+ * @brief Dequeue an item, giving up after a relative timeout
+ * @param q The queue
+ * @param item Pointer to store the dequeued item
+ * @param timeout How long to wait at most
+ * @return True if an item was dequeued, false if the timeout expired first or
+ *         the queue is closed and empty
+ */
+bool queueDequeueFor(Queue *q, void **item, const struct timespec *timeout) {
+  struct timespec deadline;
+
+  timespec_get(&deadline, TIME_UTC);
+  deadline.tv_sec += timeout->tv_sec;
+  deadline.tv_nsec += timeout->tv_nsec;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+  }
+  return queueDequeueUntil(q, item, &deadline);
+}
+
+/**
+ * @brief Try to dequeue an item from the data queue
+ *
+ * Never takes an item meant for a sleeping consumer: locked modes hand those
+ * over directly, and lock-free mode leaves one item per sleeper in the ring.
+ * An empty queue is detected without taking the lock.
+ * @param item Pointer to store the dequeued item
+ * @return True if an item was dequeued successfully, false otherwise
+ */
+bool queueTryDequeue(Queue *q, void **item) {
+  if (IsPersistentMode(q)) {
+    return false;
+  }
+  if (IsLockFreeMode(q)) {
+    size_t keep = atomic_load_explicit(&q->counters.wait_count, memory_order_relaxed);
+    if (!LfPop(q, item, keep)) {
+      NotifyClear(q);
+      return false;
+    }
+    LfWakeProducers(q);
+    return true;
+  }
+
+  // Stale reads only make us miss an item that arrived just now
+  if (CounterGet(&q->counters.item_count) == 0) {
+    return false;
+  }
+
+  QueueLock(q);
+
+  // Dequeue from the data queue
+  bool taken = StorePop(q, item);
+  QueueUnlock(q);
+
+  return taken;
+}
+
+/**
+ * @brief Enqueue a batch of items under a single lock acquisition
+ *
+ * In bounded mode this blocks until every item has found a slot. Lock-free
+ * mode publishes the items one by one and checks for sleepers once.
+ * @param items The items to enqueue, in order
+ * @param count Number of items
+ */
+void queueEnqueueMany(Queue *q, void **items, size_t count) {
+  if (IsPersistentMode(q)) {
+    return;
+  }
+  if (IsLockFreeMode(q)) {
+    size_t pushed = 0;
+    while (pushed < count && LfEnqueue(q, items[pushed])) {
+      pushed++;
+    }
+    if (pushed > 0) {
+      LfWakeWaiter(q);
+    }
+    return;
+  }
+
+  SpinForSpace(q);
+  QueueLock(q);
+
+  while (count > 0 && !IsClosed(q)) {
+    // Whatever does not fit waits its turn behind earlier producers
+    if (ProducerMustWait(q)) {
+      ParkProducer(q, items, count, 0);
+      break;
+    }
+
+    size_t given = HandOff(q, items, count);
+    items += given;
+    count -= given;
+    if (count == 0) {
+      break;
+    }
+
+    size_t stored = StorePushMany(q, items, count);
+    if (stored == 0) {  // Out of memory
+      break;
+    }
+
+    items += stored;
+    count -= stored;
+  }
+
+  QueueUnlock(q);
+}
+
+/**
+ * @brief Dequeue up to max items, blocking until at least one is available
+ *
+ * The caller keeps its FIFO position among blocked consumers and takes the
+ * whole batch on its turn.
+ * @param items Array to store the dequeued items
+ * @param max Capacity of the array
+ * @return The number of items dequeued, 0 only if max is 0 or the queue is
+ *         closed and empty
+ */
+size_t queueDequeueMany(Queue *q, void **items, size_t max) {
+  if (max == 0 || IsPersistentMode(q)) {
+    return 0;
+  }
+
+  SpinForItems(q);
+  QueueLock(q);
+
+  size_t taken = TakeItems(q, items, max, NULL);
+
+  QueueUnlock(q);
+  return taken;
+}
+
+/**
+ * @brief Dequeue up to max items without blocking
+ * @param items Array to store the dequeued items
+ * @param max Capacity of the array
+ * @return The number of items dequeued, 0 if the queue was empty
+ */
+size_t queueTryDequeueMany(Queue *q, void **items, size_t max) {
+  if (IsPersistentMode(q)) {
+    return 0;
+  }
+  if (IsLockFreeMode(q)) {
+    size_t keep = atomic_load_explicit(&q->counters.wait_count, memory_order_relaxed);
+    size_t taken = 0;
+    while (taken < max && LfPop(q, &items[taken], keep)) {
+      taken++;
+    }
+    if (taken < max) {
+      NotifyClear(q);
+    }
+    if (taken > 0) {
+      LfWakeProducers(q);
+    }
+    return taken;
+  }
+
+  if (CounterGet(&q->counters.item_count) == 0) {
+    return 0;
+  }
+
+  QueueLock(q);
+
+  size_t taken = StorePopMany(q, items, max);
+
+  QueueUnlock(q);
+  return taken;
+}
+
+/**
+ * @brief Copy a payload into a persistent queue, blocking while it is full
+ * @param payload item_size bytes to copy
+ * @return True if the payload was queued, false if q is closed or not persistent
+ */
+bool queueEnqueueCopy(Queue *q, const void *payload) {
+  PersistRing *pr = q->persist;
+  if (pr == NULL) {
+    return false;
+  }
+
+  QueueLock(q);
+
+  while (PersistFull(q) && !IsClosed(q)) {
+    // Slots consumers freed since the last commit only need committing
+    if (q->ring_head != pr->synced_head && PersistSync(q)) {
+      continue;
+    }
+    q->space_waiters++;
+    QueueWait(q, &q->space_cv);
+    q->space_waiters--;
+  }
+
+  bool stored = !IsClosed(q);
+  if (stored) {
+    memcpy(PersistSlot(q, q->ring_tail), payload, pr->item_size);
+    q->ring_tail++;
+    CounterAdd(&q->counters.item_count, 1);
+    CounterAdd(&q->counters.visited_count, 1);
+    NotifyRaise(q);
+    if (pr->item_waiters > 0) {
+      cnd_signal(&pr->item_cv);
+    }
+    PersistCommit(q);
+  }
+
+  QueueUnlock(q);
+  return stored;
+}
+
+/**
+ * @brief Copy the oldest payload out of a persistent queue, blocking while it is empty
+ * @param payload Receives item_size bytes
+ * @return True if a payload was dequeued, false once q is closed and empty,
+ *         or if it is not persistent
+ */
+bool queueDequeueCopy(Queue *q, void *payload) {
+  PersistRing *pr = q->persist;
+  if (pr == NULL) {
+    return false;
+  }
+
+  QueueLock(q);
+
+  while (IsQueueEmpty(q) && !IsClosed(q)) {
+    pr->item_waiters++;
+    CounterAdd(&q->counters.wait_count, 1);
+    QueueWait(q, &pr->item_cv);
+    CounterSub(&q->counters.wait_count, 1);
+    pr->item_waiters--;
+  }
+
+  bool taken = !IsQueueEmpty(q);
+  if (taken) {
+    PersistPop(q, payload);
+  }
+
+  QueueUnlock(q);
+  return taken;
+}
+
+/**
+ * @brief Copy the oldest payload out of a persistent queue without blocking
+ * @param payload Receives item_size bytes
+ * @return True if a payload was dequeued, false if q is empty or not persistent
+ */
+bool queueTryDequeueCopy(Queue *q, void *payload) {
+  if (q->persist == NULL) {
+    return false;
+  }
+  QueueLock(q);
+
+  bool taken = !IsQueueEmpty(q);
+  if (taken) {
+    PersistPop(q, payload);
+  }
+
+  QueueUnlock(q);
+  return taken;
+}
+
+/**
+ * @brief Commit the head and tail of a persistent queue to its file now
+ * @return True if everything queued so far is durable, false on an I/O error
+ *         or if q is not persistent
+ */
+bool queueSync(Queue *q) {
+  if (q->persist == NULL) {
+    return false;
+  }
+  QueueLock(q);
+  bool synced = PersistSync(q);
+  QueueUnlock(q);
+  return synced;
+}
+
+/**
+ * @brief Get the number of live items in the data queue
+ *
+ * Never locks unless items with a deadline are queued; then it expires those
+ * at the front under the lock, as a dequeue would, and leaves out the rest.
+ * @return The number of items in the queue
+ */
+size_t queueSize(Queue *q) {
+  if (IsLockFreeMode(q) || CounterGet(&q->deadline_items) == 0) {
+    return ItemCount(q);
+  }
+
+  QueueLock(q);
+  size_t live = StoreLiveCount(q);
+  QueueUnlock(q);
+  return live;
+}
+
+/**
+ * @brief Get the number of threads waiting on the queue
+ * @return The number of waiting threads
+ */
+size_t queueWaiting(Queue *q) {
+  return atomic_load_explicit(&q->counters.wait_count, memory_order_acquire);
+}
+
+/**
+ * @brief Get the number of producers blocked on a full queue
+ * @return The number of blocked producers
+ */
+size_t queueWaitingProducers(Queue *q) {
+  return atomic_load_explicit(&q->space_waiters, memory_order_acquire);
+}
+
+/**
+ * @brief Get the number of times the queue has been visited
+ * @return The number of visits to the queue
+ */
+size_t queueVisited(Queue *q) {
+  if (IsLockFreeMode(q)) {
+    return atomic_load_explicit(&q->enqueue_pos, memory_order_acquire);
+  }
+  return atomic_load_explicit(&q->counters.visited_count, memory_order_acquire);
+}
+
+#define SNAPSHOT_RETRIES 64  // Optimistic reads before falling back to the lock
+
+/**
+ * @brief Read size, waiting and visited counts of q as one consistent set
+ *
+ * Reads optimistically against the counters seqlock and only takes the lock
+ * if the queue stayed busy for SNAPSHOT_RETRIES attempts, or if items with
+ * a deadline are queued, so that size leaves out expired ones as in
+ * queueSize(). In lock-free mode
+ * the item and visit counts move without the lock, so the snapshot is only
+ * as consistent as two identical back-to-back reads of the ring positions.
+ * @param q The queue
+ * @return The snapshot
+ */
+QueueSnapshot queueSnapshotStats(Queue *q) {
+  QueueSnapshot snap;
+  int attempts = CounterGet(&q->deadline_items) > 0 ? 0 : SNAPSHOT_RETRIES;
+
+  for (int attempt = 0; attempt < attempts; attempt++) {
+    size_t seq = atomic_load_explicit(&q->counters.seq, memory_order_acquire);
+    if (seq & 1) {  // Someone holds the lock
+      CpuRelax();
+      continue;
+    }
+
+    snap.size = ItemCount(q);
+    snap.waiting = CounterGet(&q->counters.wait_count);
+    snap.visited = queueVisited(q);
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&q->counters.seq, memory_order_relaxed) == seq &&
+        (!IsLockFreeMode(q) ||
+         (ItemCount(q) == snap.size && queueVisited(q) == snap.visited))) {
+      return snap;
+    }
+  }
+
+  QueueLock(q);
+  snap.size = StoreLiveCount(q);
+  snap.waiting = CounterGet(&q->counters.wait_count);
+  snap.visited = queueVisited(q);
+  QueueUnlock(q);
+  return snap;
+}
+
+/**
+ * @brief Bound the adaptive spin a consumer does before parking
+ * @param q The queue
+ * @param limit Maximum spin budget in pause units, 0 to always park at once
+ */
+void queueSetSpinLimit(Queue *q, size_t limit) {
+  atomic_store_explicit(&q->spin_limit, limit, memory_order_relaxed);
+  if (atomic_load_explicit(&q->spin_budget, memory_order_relaxed) > limit) {
+    atomic_store_explicit(&q->spin_budget, limit, memory_order_relaxed);
+  }
+}
+
+/**
+ * @brief Close q: wake everybody blocked in it and refuse new items
+ *
+ * Consumers asleep in dequeue all return empty-handed right away, and so do
+ * producers blocked on a full ring, whose items are not stored. Items
+ * already queued can still be dequeued or drained; once q is empty, blocking
+ * dequeues return NULL/false instead of sleeping. Lock-free enqueues racing
+ * with the close may still land.
+ */
+void queueClose(Queue *q) {
+  QueueLock(q);
+
+  atomic_store_explicit(&q->closed, true, memory_order_release);
+  // Items published by lock-free producers go to whoever waits for them
+  ServeWaiters(q);
+  while (q->waiters.head != NULL) {
+    CvNode *waiter = q->waiters.head;
+    if (ClaimWaiter(q, waiter)) {
+      ReleaseWaiter(q, waiter);  // With nothing taken
+    }
+  }
+  // Parked producers keep whatever was not stored for them yet
+  while (q->producers.head != NULL) {
+    PwNode *producer = q->producers.head;
+    q->producers.head = producer->next;
+    cnd_signal(&producer->cv);
+  }
+  q->producers.tail = NULL;
+  cnd_broadcast(&q->space_cv);
+  if (q->persist != NULL) {
+    cnd_broadcast(&q->persist->item_cv);
+  }
+  NotifyRaise(q);
+
+  QueueUnlock(q);
+}
+
+/**
+ * @brief Get a file descriptor that is readable while q may hold items
+ *
+ * The fd is created on the first call, which must happen before q is shared
+ * between threads, and is owned and closed by q. Wait for it with poll() or
+ * epoll next to other fds, then use the try dequeue calls: the one that
+ * finds q empty resets the fd. It can stay readable after other consumers
+ * took the last items, but never stays unreadable while items are queued.
+ * It becomes readable for good once q is closed. Never read from it directly.
+ * @return The fd, or -1 if it could not be created
+ */
+int queueNotifyFd(Queue *q) {
+  if (q->notify_fd < 0 && NotifyOpen(q) && ItemCount(q) > 0) {
+    NotifyRaise(q);
+  }
+  return q->notify_fd;
+}
+
+/**
+ * @brief Check if q has been closed
+ */
+bool queueIsClosed(Queue *q) {
+  return IsClosed(q);
+}
+
+#define DRAIN_BATCH 64  // Fallback batch size if the array cannot be allocated
+
+/**
+ * @brief Remove every queued item and hand them to fn in one batch
+ *
+ * fn runs without the lock held, so it may use q. Typically called after
+ * queueClose() to reclaim what no consumer will get to.
+ * @param fn Called with the drained items, in queue order
+ * @param ctx Passed through to fn
+ * @return The number of items drained
+ */
+size_t queueDrain(Queue *q, QueueDrainFn fn, void *ctx) {
+  if (IsPersistentMode(q)) {
+    return 0;
+  }
+  QueueLock(q);
+
+  size_t count = ItemCount(q);
+  void **items = count > 0 ? malloc(count * sizeof(void *)) : NULL;
+  if (items != NULL) {
+    count = StorePopMany(q, items, count);
+    QueueUnlock(q);
+    fn(items, count, ctx);
+    free(items);
+    return count;
+  }
+
+  // Out of memory, or nothing to drain: fall back to fixed batches
+  void *batch[DRAIN_BATCH];
+  size_t drained = 0;
+  size_t n;
+  while ((n = StorePopMany(q, batch, DRAIN_BATCH)) > 0) {
+    QueueUnlock(q);
+    fn(batch, n, ctx);
+    drained += n;
+    QueueLock(q);
+  }
+
+  QueueUnlock(q);
+  return drained;
+}
+
+/**
+ * @brief Sum the instrumentation of every thread that used a queue
+ *
+ * Cheap enough to scrape periodically; counters of running threads are read
+ * without stopping them, so the sum can lag a little behind.
+ * @param out Filled in; all zero without QUEUE_STATS
+ * @return True if the library was built with QUEUE_STATS
+ */
+bool queueStats(QueueStats *out) {
+  *out = (QueueStats){0};
+#ifdef QUEUE_STATS
+  call_once(&statsOnce, StatsInit);
+  mtx_lock(&statsMtx);
+  *out = statsRetired;
+  for (ThreadStats *ts = statsThreads; ts != NULL; ts = ts->next) {
+    StatsMerge(out, ts);
+  }
+  mtx_unlock(&statsMtx);
+  return true;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @brief Estimate a percentile of a histogram
+ * @param h The histogram
+ * @param p Percentile in [0, 100]
+ * @return Upper bound of the bucket holding the percentile, in nanoseconds;
+ *         within 25% of the exact value
+ */
+uint64_t queueHistogramPercentile(const QueueHistogram *h, double p) {
+  if (h->count == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(p / 100.0 * (double)h->count);
+  if (rank >= h->count) {
+    rank = h->count - 1;
+  }
+
+  uint64_t seen = 0;
+  for (size_t b = 0; b < QUEUE_STATS_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen > rank) {
+      if (b < 4) {
+        return b;
+      }
+      int exp = (int)(b / 4) + 1;
+      uint64_t upper = ((4 + (b & 3) + 1) << (exp - 2)) - 1;
+      return upper < h->max_ns ? upper : h->max_ns;
+    }
+  }
+  return h->max_ns;
+}
+
+/* -------------------Multi-Queue Select ----------------*/
+
+#define SELECT_INLINE 8  // Queues dequeueAny() waits on without allocating
+
+/**
+ * @brief Link a dequeueAny() record into q's waiter FIFO
+ *
+ * Serves it on the spot if q holds items nobody ahead of us waits for.
+ * @return True if the record is left linked, false if it was served or q
+ *         is closed and empty
+ */
+static bool SelectLink(Queue *q, CvNode *record) {
+  QueueLock(q);
+  if (!record->pinned) {
+    q->parked++;  // Keeps q alive until SelectUnlink() lets go, see QueueFinalize()
+    record->pinned = true;
+  }
+
+  record->taken = 0;
+  record->prev = q->waiters.tail;
+  record->next = NULL;
+  record->queued = true;
+  if (q->waiters.head == NULL) {
+    q->waiters.head = record;
+  } else {
+    q->waiters.tail->next = record;
+  }
+  q->waiters.tail = record;
+
+  // The same handshake with lock-free producers as in TakeItems()
+  atomic_fetch_add(&q->counters.wait_count, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  ServeWaiters(q);
+  if (record->queued && IsClosed(q)) {
+    UnlinkWaiter(q, record);  // queueClose() has already released everyone
+  }
+
+  bool queued = record->queued;
+  QueueUnlock(q);
+  return queued;
+}
+
+/**
+ * @brief Remove a dequeueAny() record from q unless somebody already did
+ *
+ * Keeps q pinned for the next round, unless this is the last one or q is
+ * closed and empty; such a queue is retired and never touched again, so q
+ * may be destroyed as soon as the lock is dropped.
+ * @param last dequeueAny() is about to return
+ */
+static void SelectUnlink(Queue *q, CvNode *record, bool last) {
+  QueueLock(q);
+  if (record->queued) {
+    UnlinkWaiter(q, record);
+  }
+  if (last || (IsClosed(q) && IsQueueEmpty(q))) {
+    record->retired = true;
+    record->pinned = false;
+    q->parked--;
+  }
+  QueueUnlock(q);
+}
+
+/**
+ * @brief Dequeue an item from whichever of several queues has one first
+ *
+ * Polls the queues in order, then parks once with a waiter record in every
+ * queue's FIFO. The first queue to serve a record wins and the records on
+ * the others are cancelled, so the caller keeps its FIFO position among the
+ * consumers of each queue and is never handed more than one item. Queues
+ * earlier in qs win when several already hold items. A queue may be closed
+ * and destroyed while the call waits on it: destroy waits for the call to
+ * let go, which it does once it finds the queue closed and empty.
+ * @param qs The queues, which must be valid when the call starts
+ * @param n Number of queues
+ * @param which Where to store the index of the queue the item came from,
+ *        may be NULL
+ * @return The dequeued item, or NULL once every queue is closed and empty
+ */
+void *dequeueAny(Queue **qs, size_t n, size_t *which) {
+  void *item = NULL;
+
+  for (size_t i = 0; i < n; i++) {
+    if (IsPersistentMode(qs[i])) {
+      return NULL;
+    }
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (queueTryDequeue(qs[i], &item)) {
+      if (which != NULL) {
+        *which = i;
+      }
+      return item;
+    }
+  }
+
+  CvNode inline_records[SELECT_INLINE];
+  CvNode *records = inline_records;
+  if (n > SELECT_INLINE) {
+    records = malloc(n * sizeof(CvNode));
+    if (records == NULL) {
+      return NULL;
+    }
+  }
+
+  CvSelect select;
+  mtx_init(&select.mtx, mtx_plain);
+  cnd_init(&select.cv);
+  select.records = records;
+  select.item = NULL;
+  for (size_t i = 0; i < n; i++) {
+    records[i].items = &select.item;
+    records[i].max = 1;
+    records[i].select = &select;
+    records[i].async = NULL;
+    records[i].queued = false;
+    records[i].pinned = false;
+    records[i].retired = false;
+  }
+
+  // Queues closed under us release our records unserved; go around again
+  // on the others until an item arrives or no queue is left open
+  for (;;) {
+    size_t linked = 0;
+    size_t registered = 0;
+    bool woken = false;
+
+    select.which = SIZE_MAX;
+    select.woken = false;
+    while (registered < n && !woken) {
+      if (!records[registered].retired) {
+        linked += SelectLink(qs[registered], &records[registered]);
+      }
+      registered++;
+      mtx_lock(&select.mtx);
+      woken = select.woken;
+      mtx_unlock(&select.mtx);
+    }
+
+    mtx_lock(&select.mtx);
+    while (!select.woken && linked > 0) {
+      cnd_wait(&select.cv, &select.mtx);
+    }
+    mtx_unlock(&select.mtx);
+
+    bool last = select.which != SIZE_MAX || linked == 0;
+    for (size_t i = 0; i < n; i++) {
+      if (records[i].pinned) {
+        SelectUnlink(qs[i], &records[i], last);
+      }
+    }
+    if (last) {
+      break;
+    }
+  }
+
+  if (select.which != SIZE_MAX) {
+    item = select.item;
+    STATS_SINCE(QUEUE_STAT_WAKE, records[select.which].signaled_at);
+    if (which != NULL) {
+      *which = select.which;
+    }
+  }
+  mtx_destroy(&select.mtx);
+  cnd_destroy(&select.cv);
+  if (records != inline_records) {
+    free(records);
+  }
+  return item;
+}
+
+/* -------------------Async Dequeue ----------------*/
+
+/**
+ * @brief Take the next item of q without blocking a thread, through fn
+ *
+ * If nobody is queued ahead and an item is available, fn gets it right away.
+ * Otherwise a record takes the place in the waiter FIFO a blocking dequeue
+ * would get, and the producer that serves it runs fn after dropping the
+ * lock, or hands it to the executor set with queueSetExecutor(). fn gets
+ * NULL once q is closed and empty, also for records still waiting when q is
+ * closed or destroyed. Each call delivers at most one item; call again from
+ * fn for the next. SPSC queues are rejected: the producer would pop for the
+ * record while the consumer thread is free to pop at the same time, and the
+ * SPSC ring allows only one popping thread.
+ * @param fn Called with the item, or NULL
+ * @param ctx Passed through to fn
+ * @return True if fn will be called, false if the record could not be
+ *         allocated or q is an SPSC or persistent queue
+ */
+bool queueDequeueAsync(Queue *q, QueueAsyncFn fn, void *ctx) {
+  if (q->mode == QUEUE_MODE_SPSC || IsPersistentMode(q)) {
+    return false;
+  }
+  CvAsync *record = malloc(sizeof(CvAsync));
+  if (record == NULL) {
+    return false;
+  }
+  record->fn = fn;
+  record->ctx = ctx;
+  record->queue = q;
+  CvNode *waiter = &record->node;
+  waiter->items = &record->item;
+  waiter->max = 1;
+  waiter->taken = 0;
+  waiter->select = NULL;
+  waiter->async = record;
+
+  QueueLock(q);
+
+  if (IsCvQueueEmpty(q)) {
+    waiter->taken = StorePopMany(q, &record->item, 1);
+  }
+  if (waiter->taken > 0 || IsClosed(q)) {
+    AsyncComplete(q, record);
+    QueueUnlock(q);
+    return true;
+  }
+
+  waiter->prev = q->waiters.tail;
+  waiter->next = NULL;
+  if (q->waiters.head == NULL) {
+    q->waiters.head = waiter;
+  } else {
+    q->waiters.tail->next = waiter;
+  }
+  q->waiters.tail = waiter;
+
+  // The same handshake with lock-free producers as in TakeItems()
+  atomic_fetch_add(&q->counters.wait_count, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (IsLockFreeMode(q)) {
+    ServeWaiters(q);
+  }
+
+  QueueUnlock(q);
+  return true;
+}
+
+/**
+ * @brief Set where the dequeueAsync() callbacks of q run
+ *
+ * Without an executor they run inline on the thread that served them, a
+ * producer most of the time. Set it before q is shared.
+ * @param executor Must eventually call fn(item, fn_ctx), on any thread
+ * @param ctx Passed through to executor
+ */
+void queueSetExecutor(Queue *q, QueueExecutorFn executor, void *ctx) {
+  QueueLock(q);
+  q->executor = executor;
+  q->executor_ctx = ctx;
+  QueueUnlock(q);
+}
+
+/* -------------------Producer Buffers ----------------*/
+
+/*
+ * A producer can stage items in a thread-local buffer and publish them with
+ * one queueEnqueueMany(), which hands them to waiters or splices the whole
+ * chain onto the tail under a single lock acquisition. A buffer targets one
+ * queue at a time. It is flushed when it holds max_items items, as soon as a
+ * consumer is asleep on the queue, when the thread moves on to another queue
+ * and when a thread started with thrd_create() exits.
+ *
+ * The time threshold is enforced lazily: there is no timer, and a buffer is
+ * only checked against max_delay_ns when its thread stages another item.
+ * Items staged by a thread that then goes quiet stay unpublished, and
+ * consumers asleep on the queue stay asleep, until it calls flushProducer().
+ */
+#define PRODUCER_BUFFER_MAX 256          // Capacity of a staging buffer
+#define PRODUCER_DEFAULT_ITEMS 64        // Default count threshold
+#define PRODUCER_DEFAULT_DELAY_NS 100000L  // Default time threshold, 100us
+
+typedef struct ProducerBuffer {
+  Queue *q;                  // Queue the staged items are headed for
+  size_t count;
+  size_t max_items;          // Flush once this many items are staged
+  long max_delay_ns;         // Flush once the oldest is this old, 0 for never
+  bool registered;           // Exit hook installed for this thread
+  struct timespec first;     // When the oldest staged item was staged
+  void *items[PRODUCER_BUFFER_MAX];
+} ProducerBuffer;
+
+static _Thread_local ProducerBuffer producerBuffer = {
+  .max_items = PRODUCER_DEFAULT_ITEMS,
+  .max_delay_ns = PRODUCER_DEFAULT_DELAY_NS,
+};
+static once_flag producerKeyOnce = ONCE_FLAG_INIT;
+static tss_t producerKey;     // Only there to run ProducerExit() at thread exit
+
+/**
+ * @brief Publish whatever pb has staged
+ */
+static void ProducerFlush(ProducerBuffer *pb) {
+  if (pb->count > 0) {
+    queueEnqueueMany(pb->q, pb->items, pb->count);
+    pb->count = 0;
+  }
+}
+
+/**
+ * @brief tss destructor: flush the buffer of an exiting thread
+ */
+static void ProducerExit(void *arg) {
+  ProducerFlush(arg);
+}
+
+static void ProducerCreateKey(void) {
+  tss_create(&producerKey, ProducerExit);
+}
+
+/**
+ * @brief Stage an item for q in this thread's producer buffer
+ *
+ * Items reach q in order, but only once the buffer is flushed; see the
+ * thresholds above and setProducerFlush(). Flushes only happen inside this
+ * call, so a consumer that goes to sleep after an item was staged gets it on
+ * the producer's next call at the earliest. Producers must call
+ * flushProducer() before going idle, and before q is destroyed.
+ * @param item The item to enqueue
+ */
+void queueEnqueueBuffered(Queue *q, void *item) {
+  ProducerBuffer *pb = &producerBuffer;
+
+  if (IsPersistentMode(q)) {
+    return;
+  }
+  if (pb->q != q) {
+    ProducerFlush(pb);
+    pb->q = q;
+  }
+  if (pb->count == 0) {
+    timespec_get(&pb->first, TIME_UTC);
+    if (!pb->registered) {
+      call_once(&producerKeyOnce, ProducerCreateKey);
+      tss_set(producerKey, pb);
+      pb->registered = true;
+    }
+  }
+  pb->items[pb->count++] = item;
+
+  if (pb->count >= pb->max_items ||
+      atomic_load_explicit(&q->counters.wait_count, memory_order_relaxed) > 0 ||
+      (pb->max_delay_ns > 0 && ElapsedNs(&pb->first) >= pb->max_delay_ns)) {
+    ProducerFlush(pb);
+  }
+}
+
+/**
+ * @brief Publish the items this thread has staged with enqueueBuffered()
+ */
+void flushProducer(void) {
+  ProducerFlush(&producerBuffer);
+}
+
+/**
+ * @brief Set the flush thresholds of this thread's producer buffer
+ * @param max_items Flush once this many items are staged, clamped to
+ *                  [1, PRODUCER_BUFFER_MAX]; 1 disables buffering
+ * @param max_delay_ns Flush on the next enqueueBuffered() once the oldest
+ *                     staged item is this old, there is no timer; 0 for no
+ *                     time threshold
+ */
+void setProducerFlush(size_t max_items, long max_delay_ns) {
+  ProducerBuffer *pb = &producerBuffer;
+
+  pb->max_items = max_items < 1 ? 1
+                  : max_items > PRODUCER_BUFFER_MAX ? PRODUCER_BUFFER_MAX : max_items;
+  pb->max_delay_ns = max_delay_ns;
+  if (pb->count >= pb->max_items) {
+    ProducerFlush(pb);
+  }
+}
+
+/* -------------------Sharded Queue ----------------*/
+
+static atomic_size_t nextThreadSlot;             // Hands out thread slots
+static _Thread_local size_t threadSlot = SIZE_MAX;  // This thread's slot
+
+/**
+ * @brief Pick the calling thread's home shard
+ *
+ * Threads get consecutive slots on first use, so with as many shards per
+ * node as threads on it every thread ends up with a shard of its own. The
+ * home shard is always one of the shards on the thread's own NUMA node.
+ */
+static size_t HomeShard(ShardedQueue *sq) {
+  if (threadSlot == SIZE_MAX) {
+    threadSlot = atomic_fetch_add_explicit(&nextThreadSlot, 1,
+                                           memory_order_relaxed);
+  }
+  size_t node = sq->node_count > 1 ? ThreadNumaNode() % sq->node_count : 0;
+  return node * sq->shards_per_node + threadSlot % sq->shards_per_node;
+}
+
+/**
+ * @brief Get the i-th shard to probe from home
+ *
+ * The shards on home's node come first, starting at home, then those of
+ * the other nodes in turn, so consumers only steal across the interconnect
+ * once their own node has run dry.
+ */
+static size_t ShardProbe(const ShardedQueue *sq, size_t home, size_t i) {
+  size_t per_node = sq->shards_per_node;
+  size_t offset = home % per_node;
+  size_t node = (home / per_node + i / per_node) % sq->node_count;
+  return node * per_node + (offset + i) % per_node;
+}
+
+/**
+ * @brief Allocate a sharded queue of node_count groups of per_node shards
+ * @param numa Place each group's shards on the NUMA node of the same index
+ * @return The new queue, or NULL on allocation failure
+ */
+static ShardedQueue *ShardedQueueAlloc(size_t node_count, size_t per_node, bool numa) {
+  ShardedQueue *sq = malloc(sizeof(ShardedQueue));
+  if (sq == NULL) {
+    return NULL;
+  }
+  sq->shard_count = node_count * per_node;
+  sq->node_count = node_count;
+  sq->shards_per_node = per_node;
+  sq->shards = calloc(sq->shard_count, sizeof(Queue *));
+  if (sq->shards == NULL) {
+    free(sq);
+    return NULL;
+  }
+
+  atomic_init(&sq->idle_count, 0);
+  atomic_init(&sq->closed, false);
+  mtx_init(&sq->idle_mtx, mtx_plain);
+  cnd_init(&sq->idle_cv);
+  for (size_t i = 0; i < sq->shard_count; i++) {
+    int node = numa ? NumaNode((int)(i / per_node)) : -1;
+    sq->shards[i] = QueueAlloc(node);
+    if (sq->shards[i] == NULL) {
+      shardedQueueDestroy(sq);
+      return NULL;
+    }
+    QueueInitList(sq->shards[i], 0, node);
+  }
+  return sq;
+}
+
+/**
+ * @brief Create a sharded queue
+ * @param shard_count Number of sub-queues, typically the number of cores
+ * @return The new queue, or NULL on allocation failure
+ */
+ShardedQueue *shardedQueueCreate(size_t shard_count) {
+  return ShardedQueueAlloc(1, shard_count > 0 ? shard_count : 1, false);
+}
+
+/**
+ * @brief Create a sharded queue with shards_per_node shards on each NUMA node
+ *
+ * Each shard's handle and node slabs live on its node. Threads push to a
+ * shard on their own node, and consumers drain their node's shards before
+ * stealing from remote ones. Needs a QUEUE_NUMA build; otherwise the
+ * machine counts as a single node.
+ * @param shards_per_node Sub-queues per node, typically the cores per node
+ * @return The new queue, or NULL on allocation failure
+ */
+ShardedQueue *shardedQueueCreateNuma(size_t shards_per_node) {
+  size_t nodes = NumaNodeCount();
+  return ShardedQueueAlloc(nodes > 0 ? nodes : 1,
+                           shards_per_node > 0 ? shards_per_node : 1, true);
+}
+
+/**
+ * @brief Close a sharded queue: wake every sleeping consumer, refuse new items
+ *
+ * Closes every shard, see queueClose(). Items already queued can still be
+ * dequeued; once every shard is empty, shardedDequeue() returns NULL
+ * instead of sleeping.
+ * @param sq The sharded queue
+ */
+void shardedQueueClose(ShardedQueue *sq) {
+  mtx_lock(&sq->idle_mtx);
+  atomic_store(&sq->closed, true);
+  for (size_t i = 0; i < sq->shard_count && sq->shards[i] != NULL; i++) {
+    queueClose(sq->shards[i]);
+  }
+  cnd_broadcast(&sq->idle_cv);
+  mtx_unlock(&sq->idle_mtx);
+}
+
+/**
+ * @brief Check whether a sharded queue has been closed
+ * @param sq The sharded queue
+ * @return True once shardedQueueClose() has been called
+ */
+bool shardedQueueIsClosed(ShardedQueue *sq) {
+  return atomic_load(&sq->closed);
+}
+
+/**
+ * @brief Destroy a sharded queue
+ *
+ * Closes it first and waits for the consumers asleep in shardedDequeue()
+ * to leave; no other thread may still be using it.
+ * @param sq The queue, may be NULL
+ */
+void shardedQueueDestroy(ShardedQueue *sq) {
+  if (sq == NULL) {
+    return;
+  }
+  shardedQueueClose(sq);
+  mtx_lock(&sq->idle_mtx);
+  while (atomic_load(&sq->idle_count) > 0) {
+    mtx_unlock(&sq->idle_mtx);
+    thrd_yield();
+    mtx_lock(&sq->idle_mtx);
+  }
+  mtx_unlock(&sq->idle_mtx);
+
+  for (size_t i = 0; i < sq->shard_count && sq->shards[i] != NULL; i++) {
+    QueueFinalize(sq->shards[i]);
+    QueueFree(sq->shards[i]);
+  }
+  mtx_destroy(&sq->idle_mtx);
+  cnd_destroy(&sq->idle_cv);
+  free(sq->shards);
+  free(sq);
+}
+
+/**
+ * @brief Enqueue an item into the calling thread's home shard
+ * @param sq The sharded queue
+ * @param item The item to enqueue
+ */
+void shardedEnqueue(ShardedQueue *sq, void *item) {
+  queueEnqueue(sq->shards[HomeShard(sq)], item);
+
+  // Pairs with the fence in shardedDequeue()
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&sq->idle_count, memory_order_relaxed) > 0) {
+    mtx_lock(&sq->idle_mtx);
+    cnd_signal(&sq->idle_cv);
+    mtx_unlock(&sq->idle_mtx);
+  }
+}
+
+/**
+ * @brief Try to dequeue from the home shard, then steal from the others
+ * @param sq The sharded queue
+ * @param item Pointer to store the dequeued item
+ * @return True if an item was dequeued, false if every shard was empty
+ */
+bool shardedTryDequeue(ShardedQueue *sq, void **item) {
+  size_t home = HomeShard(sq);
+
+  for (size_t i = 0; i < sq->shard_count; i++) {
+    if (queueTryDequeue(sq->shards[ShardProbe(sq, home, i)], item)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Dequeue an item, sleeping while every shard is empty
+ * @param sq The sharded queue
+ * @return The dequeued item, or NULL once the queue is closed and empty
+ */
+void *shardedDequeue(ShardedQueue *sq) {
+  void *item;
+
+  while (!shardedTryDequeue(sq, &item)) {
+    mtx_lock(&sq->idle_mtx);
+
+    // Announce ourselves before the final scan so a producer that pushes
+    // after it is guaranteed to see us and signal
+    atomic_fetch_add(&sq->idle_count, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    // shardedQueueClose() takes idle_mtx, so it cannot slip in before the wait
+    bool found = shardedTryDequeue(sq, &item);
+    bool closed = atomic_load(&sq->closed);
+    if (!found && !closed) {
+      cnd_wait(&sq->idle_cv, &sq->idle_mtx);
+      // Woken by a close: take what is left while destroy still waits for us
+      closed = atomic_load(&sq->closed);
+      if (closed) {
+        found = shardedTryDequeue(sq, &item);
+      }
+    }
+    atomic_fetch_sub(&sq->idle_count, 1);
+
+    mtx_unlock(&sq->idle_mtx);
+    if (found) {
+      break;
+    }
+    if (closed) {
+      return NULL;
+    }
+  }
+  return item;
+}
+
+/**
+ * @brief Get the number of items across all shards
+ * @param sq The sharded queue
+ * @return The number of items in the queue
+ */
+size_t shardedSize(ShardedQueue *sq) {
+  size_t total = 0;
+  for (size_t i = 0; i < sq->shard_count; i++) {
+    total += queueSize(sq->shards[i]);
+  }
+  return total;
+}
+
+/**
+ * @brief Get the number of consumers asleep in shardedDequeue()
+ * @param sq The sharded queue
+ * @return The number of sleeping consumers
+ */
+size_t shardedWaiting(ShardedQueue *sq) {
+  return atomic_load(&sq->idle_count);
+}
+
+/* -------------------Default Queue ----------------*/
+
+/*
+ * The original single-queue API, operating on a process-wide instance.
+ */
+
+/**
+ * @brief Initialize the queue with nodes for `reserve` items preallocated
+ * @param reserve Number of nodes to allocate up front (0 for none)
+ */
+void initQueueReserve(size_t reserve) {
+  QueueInitList(&defaultQueue, reserve, -1);
+}
+
+/**
+ * @brief Initialize the queue
+ */
+void initQueue(void) {
+  initQueueReserve(0);
+}
+
+/**
+ * @brief Initialize the queue in bounded mode, backed by a fixed ring
+ * @param capacity Maximum number of queued items, rounded up to a power of two
+ * @return True on success, false if the ring could not be allocated
+ */
+bool initQueueBounded(size_t capacity) {
+  return QueueInitBounded(&defaultQueue, capacity);
+}
+
+/**
+ * @brief Initialize the queue in lock-free mode, see queueCreateLockFree()
+ * @param capacity Maximum number of queued items, rounded up to a power of two
+ * @return True on success, false if the ring could not be allocated
+ */
+bool initQueueLockFree(size_t capacity) {
+  return QueueInitLockFree(&defaultQueue, capacity);
+}
+
+/**
+ * @brief Initialize the queue in SPSC mode, see queueCreateSpsc()
+ * @param capacity Maximum number of queued items, rounded up to a power of two
+ * @return True on success, false if the ring could not be allocated
+ */
+bool initQueueSpsc(size_t capacity) {
+  return QueueInitSpsc(&defaultQueue, capacity);
+}
+
+/**
+ * @brief Initialize the queue in persistent mode, see queueCreatePersistent()
+ * @param path File to create, or to reopen
+ * @param capacity Maximum number of queued payloads, rounded up to a power of two
+ * @param item_size Bytes per payload
+ * @return True on success, false if the file could not be used
+ */
+bool initQueuePersistent(const char *path, size_t capacity, size_t item_size) {
+  return QueueInitPersistent(&defaultQueue, path, capacity, item_size);
+}
+
+/**
+ * @brief Destroy the queue and clean up resources
+ */
+void destroyQueue(void) {
+  QueueFinalize(&defaultQueue);
+}
+
+/**
+ * @brief Enqueue an item into the data queue
+ * @param item The item to enqueue
+ */
+void enqueue(void *item) {
+  queueEnqueue(&defaultQueue, item);
+}
+
+/**
+ * @brief Enqueue an item into the data queue ahead of lower priority items
+ * @param item The item to enqueue
+ * @param prio Priority, clamped to [0, QUEUE_PRIORITY_MAX]
+ */
+void enqueueWithPriority(void *item, int prio) {
+  queueEnqueueWithPriority(&defaultQueue, item, prio);
+}
+
+/**
+ * @brief Enqueue an item into the data queue that expires at deadline
+ * @param item The item to enqueue
+ * @param deadline Absolute TIME_UTC deadline
+ */
+void enqueueWithDeadline(void *item, const struct timespec *deadline) {
+  queueEnqueueWithDeadline(&defaultQueue, item, deadline);
+}
+
+/**
+ * @brief Try to enqueue an item without blocking
+ * @param item The item to enqueue
+ * @return True if the item was enqueued, false if the queue is full or closed
+ */
+bool tryEnqueue(void *item) {
+  return queueTryEnqueue(&defaultQueue, item);
+}
+
+/**
+ * @brief Dequeue an item from the data queue
+ * @return The dequeued item, or NULL once the queue is closed and empty
+ */
+void *dequeue(void) {
+  return queueDequeue(&defaultQueue);
+}
+
+/**
+ * @brief Dequeue an item, giving up at an absolute TIME_UTC deadline
+ * @param item Pointer to store the dequeued item
+ * @param deadline Absolute deadline, NULL to wait forever
+ * @return True if an item was dequeued, false if the deadline passed first or
+ *         the queue is closed and empty
+ */
+bool dequeueUntil(void **item, const struct timespec *deadline) {
+  return queueDequeueUntil(&defaultQueue, item, deadline);
+}
+
+/**
+ * @brief Dequeue an item, giving up after a relative timeout
+ * @param item Pointer to store the dequeued item
+ * @param timeout How long to wait at most
+ * @return True if an item was dequeued, false if the timeout expired first or
+ *         the queue is closed and empty
+ */
+bool dequeueFor(void **item, const struct timespec *timeout) {
+  return queueDequeueFor(&defaultQueue, item, timeout);
+}
+
+/**
+ * @brief Take the next item of the data queue through a callback
+ * @param fn Called with the item, or NULL once the queue is closed and empty
+ * @param ctx Passed through to fn
+ * @return True if fn will be called, false if out of memory or the queue is
+ *         in SPSC or persistent mode
+ */
+bool dequeueAsync(QueueAsyncFn fn, void *ctx) {
+  return queueDequeueAsync(&defaultQueue, fn, ctx);
+}
+
+/**
+ * @brief Try to dequeue an item from the data queue
+ * @param item Pointer to store the dequeued item
+ * @return True if an item was dequeued successfully, false otherwise
+ */
+bool tryDequeue(void **item) {
+  return queueTryDequeue(&defaultQueue, item);
+}
+
+/**
+ * @brief Copy a payload into the persistent data queue
+ * @param payload item_size bytes to copy
+ * @return True if the payload was queued, false if the queue is closed
+ */
+bool enqueueCopy(const void *payload) {
+  return queueEnqueueCopy(&defaultQueue, payload);
+}
+
+/**
+ * @brief Copy the oldest payload out of the persistent data queue
+ * @param payload Receives item_size bytes
+ * @return True if a payload was dequeued, false once closed and empty
+ */
+bool dequeueCopy(void *payload) {
+  return queueDequeueCopy(&defaultQueue, payload);
+}
+
+/**
+ * @brief Copy the oldest payload out of the persistent data queue without blocking
+ * @param payload Receives item_size bytes
+ * @return True if a payload was dequeued, false if the queue is empty
+ */
+bool tryDequeueCopy(void *payload) {
+  return queueTryDequeueCopy(&defaultQueue, payload);
+}
+
+/**
+ * @brief Enqueue a batch of items under a single lock acquisition
+ * @param items The items to enqueue, in order
+ * @param count Number of items
+ */
+void enqueueMany(void **items, size_t count) {
+  queueEnqueueMany(&defaultQueue, items, count);
+}
+
+/**
+ * @brief Enqueue a caller-owned object through its embedded QueueLink
+ * @param link The link of the object to enqueue
+ */
+void enqueueIntrusive(QueueLink *link) {
+  queueEnqueueIntrusive(&defaultQueue, link);
+}
+
+/**
+ * @brief Enqueue a batch of caller-owned objects under one lock acquisition
+ * @param links The links of the objects to enqueue, in order
+ * @param count Number of links
+ */
+void enqueueIntrusiveMany(QueueLink **links, size_t count) {
+  queueEnqueueIntrusiveMany(&defaultQueue, links, count);
+}
+
+/**
+ * @brief Stage an item for the data queue in this thread's producer buffer
+ *
+ * Call flushProducer() before going idle, see queueEnqueueBuffered().
+ * @param item The item to enqueue
+ */
+void enqueueBuffered(void *item) {
+  queueEnqueueBuffered(&defaultQueue, item);
+}
+
+/**
+ * @brief Dequeue up to max items, blocking until at least one is available
+ * @param items Array to store the dequeued items
+ * @param max Capacity of the array
+ * @return The number of items dequeued, 0 only if max is 0 or the queue is
+ *         closed and empty
+ */
+size_t dequeueMany(void **items, size_t max) {
+  return queueDequeueMany(&defaultQueue, items, max);
+}
+
+/**
+ * @brief Dequeue up to max items without blocking
+ * @param items Array to store the dequeued items
+ * @param max Capacity of the array
+ * @return The number of items dequeued, 0 if the queue was empty
+ */
+size_t tryDequeueMany(void **items, size_t max) {
+  return queueTryDequeueMany(&defaultQueue, items, max);
+}
+
+/**
+ * @brief Get the number of items in the data queue
+ * @return The number of items in the queue
+ */
+size_t size(void) {
+  return queueSize(&defaultQueue);
+}
+
+/**
+ * @brief Get the number of threads waiting on the queue
+ * @return The number of waiting threads
+ */
+size_t waiting(void) {
+  return queueWaiting(&defaultQueue);
+}
+
+/**
+ * @brief Get the number of producers blocked on the full data queue
+ * @return The number of blocked producers
+ */
+size_t waitingProducers(void) {
+  return queueWaitingProducers(&defaultQueue);
+}
+
+/**
+ * @brief Get the number of times the queue has been visited
+ * @return The number of visits to the queue
+ */
+size_t visited(void) {
+  return queueVisited(&defaultQueue);
+}
+
+/**
+ * @brief Read size(), waiting() and visited() as one consistent set
+ * @return The snapshot
+ */
+QueueSnapshot snapshotStats(void) {
+  return queueSnapshotStats(&defaultQueue);
+}
+
+/**
+ * @brief Bound the adaptive spin a consumer does before parking
+ * @param limit Maximum spin budget in pause units, 0 to always park at once
+ */
+void setSpinLimit(size_t limit) {
+  queueSetSpinLimit(&defaultQueue, limit);
+}
+
+/**
+ * @brief Set the callback that receives expired items of the data queue
+ *
+ * It runs right after the lock of the queue is released, on the thread that
+ * found the items expired, so it may call into the queue; without one,
+ * expired items are simply dropped. Set it before the queue is shared.
+ * @param fn Called with the expired items in queue order
+ * @param ctx Passed through to fn
+ */
+void setReclaim(QueueDrainFn fn, void *ctx) {
+  queueSetReclaim(&defaultQueue, fn, ctx);
+}
+
+/**
+ * @brief Set where the dequeueAsync() callbacks of the data queue run
+ * @param executor Must eventually call fn(item, fn_ctx), on any thread
+ * @param ctx Passed through to executor
+ */
+void setExecutor(QueueExecutorFn executor, void *ctx) {
+  queueSetExecutor(&defaultQueue, executor, ctx);
+}
+
+/**
+ * @brief Close the data queue, waking every blocked thread
+ */
+void closeQueue(void) {
+  queueClose(&defaultQueue);
+}
+
+/**
+ * @brief Check if the data queue has been closed
+ */
+bool isQueueClosed(void) {
+  return queueIsClosed(&defaultQueue);
+}
+
+/**
+ * @brief Remove every queued item and hand them to fn in one batch
+ * @return The number of items drained
+ */
+size_t drainQueue(QueueDrainFn fn, void *ctx) {
+  return queueDrain(&defaultQueue, fn, ctx);
+}
+
+/**
+ * @brief Commit the persistent data queue to its file now
+ * @return True if everything queued so far is durable
+ */
+bool syncQueue(void) {
+  return queueSync(&defaultQueue);
+}
+
+/**
+ * @brief Get a file descriptor that is readable while the data queue may
+ *        hold items, see queueNotifyFd()
+ * @return The fd, or -1 if it could not be created
+ */
+int notifyFd(void) {
+  return queueNotifyFd(&defaultQueue);
 }
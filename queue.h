@@ -1,11 +1,264 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+/* Counters read together, see snapshotStats() */
+typedef struct QueueSnapshot {
+  size_t size;
+  size_t waiting;
+  size_t visited;
+} QueueSnapshot;
+
+/* Highest priority for enqueueWithPriority(), plain enqueue() is 0 */
+#define QUEUE_PRIORITY_MAX 8
+
+/*
+ * Instrumentation, recorded only when built with -DQUEUE_STATS. Histograms
+ * are log-linear: 4 buckets per power of two nanoseconds.
+ */
+#define QUEUE_STATS_BUCKETS 256
+
+typedef enum QueueStatId {
+  QUEUE_STAT_LOCK_WAIT,   // Time to acquire a queue lock, 0 if uncontended
+  QUEUE_STAT_LOCK_HOLD,   // Time a queue lock was held
+  QUEUE_STAT_PARK,        // Time spent asleep in a condvar wait
+  QUEUE_STAT_SOJOURN,     // Time from storing an item to removing it
+  QUEUE_STAT_WAKE,        // Time from a producer waking a consumer to it running
+  QUEUE_STAT_COUNT,
+} QueueStatId;
+
+typedef struct QueueHistogram {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t buckets[QUEUE_STATS_BUCKETS];
+} QueueHistogram;
+
+typedef struct QueueStats {
+  uint64_t lock_acquires;
+  uint64_t lock_contended;  // Acquisitions that had to wait
+  QueueHistogram hist[QUEUE_STAT_COUNT];
+} QueueStats;
+
+bool queueStats(QueueStats*);
+uint64_t queueHistogramPercentile(const QueueHistogram*, double);
+
+/*
+ * Intrusive items embed a QueueLink and are enqueued through it, so list
+ * queues need no node allocation for them. Dequeue calls hand back the link
+ * pointer; QUEUE_CONTAINER_OF(link, type, member) gets the object.
+ */
+typedef struct QueueLink {
+  void *reserved[4];
+} QueueLink;
+
+#define QUEUE_CONTAINER_OF(link, type, member) \
+  ((type *)((char *)(link) - offsetof(type, member)))
+
+/* Receives the items removed by drainQueue(), or expired ones, see setReclaim() */
+typedef void (*QueueDrainFn)(void **items, size_t count, void *ctx);
+
+/* Receives the item taken by dequeueAsync(), NULL once the queue is closed and empty */
+typedef void (*QueueAsyncFn)(void *item, void *ctx);
+
+/* Runs fn(item, fn_ctx) now or later on a thread of its choosing, see setExecutor() */
+typedef void (*QueueExecutorFn)(QueueAsyncFn fn, void *item, void *fn_ctx, void *ctx);
+
+/* Process-wide default queue */
 void initQueue(void);
+void initQueueReserve(size_t);
+bool initQueueBounded(size_t);
+bool initQueueLockFree(size_t);
+bool initQueueSpsc(size_t);
+bool initQueuePersistent(const char*, size_t, size_t);
 void destroyQueue(void);
 void enqueue(void*);
+void enqueueWithPriority(void*, int);
+void enqueueWithDeadline(void*, const struct timespec*);
+bool tryEnqueue(void*);
 void* dequeue(void);
 bool tryDequeue(void**);
+bool enqueueCopy(const void*);
+bool dequeueCopy(void*);
+bool tryDequeueCopy(void*);
+bool dequeueUntil(void**, const struct timespec*);
+bool dequeueFor(void**, const struct timespec*);
+bool dequeueAsync(QueueAsyncFn, void*);
+void enqueueMany(void**, size_t);
+void enqueueBuffered(void*);
+void enqueueIntrusive(QueueLink*);
+void enqueueIntrusiveMany(QueueLink**, size_t);
+size_t dequeueMany(void**, size_t);
+size_t tryDequeueMany(void**, size_t);
 size_t size(void);
 size_t waiting(void);
+size_t waitingProducers(void);
 size_t visited(void);
+QueueSnapshot snapshotStats(void);
+void setSpinLimit(size_t);
+void setReclaim(QueueDrainFn, void*);
+void setExecutor(QueueExecutorFn, void*);
+void closeQueue(void);
+bool isQueueClosed(void);
+size_t drainQueue(QueueDrainFn, void*);
+bool syncQueue(void);
+int notifyFd(void);
+
+/*
+ * Independent queue instances, each with its own lock and waiters. Handles
+ * are aligned to QUEUE_CACHE_LINE_SIZE and producer and consumer state sit on
+ * separate lines, so neighbouring queues or threads do not false-share.
+ */
+#ifndef QUEUE_CACHE_LINE_SIZE
+#define QUEUE_CACHE_LINE_SIZE 64
+#endif
+
+typedef struct Queue Queue;
+
+Queue* queueCreate(void);
+Queue* queueCreateReserve(size_t);
+Queue* queueCreateBounded(size_t);
+Queue* queueCreateLockFree(size_t);
+Queue* queueCreateSpsc(size_t);
+Queue* queueCreateOnNode(int, size_t);  // List mode on a NUMA node (QUEUE_NUMA builds)
+Queue* queueCreatePersistent(const char*, size_t, size_t);  // Payload copies in a file
+void queueDestroy(Queue*);
+void queueEnqueue(Queue*, void*);
+void queueEnqueueWithPriority(Queue*, void*, int);
+void queueEnqueueWithDeadline(Queue*, void*, const struct timespec*);
+bool queueTryEnqueue(Queue*, void*);
+void* queueDequeue(Queue*);
+bool queueTryDequeue(Queue*, void**);
+bool queueEnqueueCopy(Queue*, const void*);
+bool queueDequeueCopy(Queue*, void*);
+bool queueTryDequeueCopy(Queue*, void*);
+bool queueDequeueUntil(Queue*, void**, const struct timespec*);
+bool queueDequeueFor(Queue*, void**, const struct timespec*);
+bool queueDequeueAsync(Queue*, QueueAsyncFn, void*);
+void queueEnqueueMany(Queue*, void**, size_t);
+void queueEnqueueBuffered(Queue*, void*);
+void queueEnqueueIntrusive(Queue*, QueueLink*);
+void queueEnqueueIntrusiveMany(Queue*, QueueLink**, size_t);
+size_t queueDequeueMany(Queue*, void**, size_t);
+size_t queueTryDequeueMany(Queue*, void**, size_t);
+size_t queueSize(Queue*);
+size_t queueWaiting(Queue*);
+size_t queueWaitingProducers(Queue*);
+size_t queueVisited(Queue*);
+QueueSnapshot queueSnapshotStats(Queue*);
+void queueSetSpinLimit(Queue*, size_t);
+void queueSetReclaim(Queue*, QueueDrainFn, void*);
+void queueSetExecutor(Queue*, QueueExecutorFn, void*);
+void queueClose(Queue*);
+bool queueIsClosed(Queue*);
+size_t queueDrain(Queue*, QueueDrainFn, void*);
+bool queueSync(Queue*);
+int queueNotifyFd(Queue*);
+
+/* Block on several queues at once; the first to get an item serves it */
+void* dequeueAny(Queue**, size_t, size_t*);
+
+/* Per-thread producer buffers, shared by all queues; flush before going idle */
+void flushProducer(void);
+void setProducerFlush(size_t, long);
+
+/*
+ * Sharded queue: per-thread home shards with work stealing, FIFO per shard.
+ * shardedQueueCreateNuma() groups the shards by NUMA node and steals from
+ * the thread's own node first.
+ */
+typedef struct ShardedQueue ShardedQueue;
+
+ShardedQueue* shardedQueueCreate(size_t);
+ShardedQueue* shardedQueueCreateNuma(size_t);
+void shardedQueueDestroy(ShardedQueue*);
+void shardedQueueClose(ShardedQueue*);
+bool shardedQueueIsClosed(ShardedQueue*);
+void shardedEnqueue(ShardedQueue*, void*);
+bool shardedTryDequeue(ShardedQueue*, void**);
+void* shardedDequeue(ShardedQueue*);
+size_t shardedSize(ShardedQueue*);
+size_t shardedWaiting(ShardedQueue*);
+
+/*
+ * DEFINE_QUEUE(name, T) generates a typed queue whose values are stored by
+ * value in the node or ring slot that would otherwise hold the void*, so
+ * small payloads need no per-item allocation. T must fit in a pointer. The
+ * handle is a Queue underneath, with every mode and the same blocking,
+ * FIFO-waiter and close semantics; name##Queue() gets it for the untyped
+ * calls. Dequeue calls return false once the queue is closed and empty, so
+ * zero is an ordinary value.
+ *
+ *   DEFINE_QUEUE(IntQueue, int)
+ *   IntQueue *q = IntQueueCreate();
+ *   IntQueueEnqueue(q, 42);
+ *   int value;
+ *   IntQueueDequeue(q, &value);
+ */
+#define DEFINE_QUEUE(name, T)                                                  \
+  _Static_assert(sizeof(T) <= sizeof(void *),                                 \
+                 "DEFINE_QUEUE(" #name "): values must fit in a void*");      \
+  typedef struct name name;                                                    \
+                                                                               \
+  static inline void *name##Pack(T value) {                                    \
+    void *item = NULL;                                                         \
+    memcpy(&item, &value, sizeof(T));                                          \
+    return item;                                                               \
+  }                                                                            \
+  static inline T name##Unpack(void *item) {                                   \
+    T value;                                                                   \
+    memcpy(&value, &item, sizeof(T));                                          \
+    return value;                                                              \
+  }                                                                            \
+  static inline Queue *name##Queue(name *q) { return (Queue *)q; }             \
+  static inline name *name##Create(void) { return (name *)queueCreate(); }     \
+  static inline name *name##CreateBounded(size_t capacity) {                   \
+    return (name *)queueCreateBounded(capacity);                               \
+  }                                                                            \
+  static inline name *name##CreateLockFree(size_t capacity) {                  \
+    return (name *)queueCreateLockFree(capacity);                              \
+  }                                                                            \
+  static inline name *name##CreateSpsc(size_t capacity) {                      \
+    return (name *)queueCreateSpsc(capacity);                                  \
+  }                                                                            \
+  static inline void name##Destroy(name *q) { queueDestroy((Queue *)q); }      \
+  static inline void name##Enqueue(name *q, T value) {                         \
+    queueEnqueue((Queue *)q, name##Pack(value));                               \
+  }                                                                            \
+  static inline bool name##TryEnqueue(name *q, T value) {                      \
+    return queueTryEnqueue((Queue *)q, name##Pack(value));                     \
+  }                                                                            \
+  static inline bool name##Dequeue(name *q, T *value) {                        \
+    void *item;                                                                \
+    if (queueDequeueMany((Queue *)q, &item, 1) == 0) {                         \
+      return false;                                                            \
+    }                                                                          \
+    *value = name##Unpack(item);                                               \
+    return true;                                                               \
+  }                                                                            \
+  static inline bool name##TryDequeue(name *q, T *value) {                     \
+    void *item;                                                                \
+    if (!queueTryDequeue((Queue *)q, &item)) {                                 \
+      return false;                                                            \
+    }                                                                          \
+    *value = name##Unpack(item);                                               \
+    return true;                                                               \
+  }                                                                            \
+  static inline bool name##DequeueFor(name *q, T *value,                       \
+                                      const struct timespec *timeout) {        \
+    void *item;                                                                \
+    if (!queueDequeueFor((Queue *)q, &item, timeout)) {                        \
+      return false;                                                            \
+    }                                                                          \
+    *value = name##Unpack(item);                                               \
+    return true;                                                               \
+  }                                                                            \
+  static inline size_t name##Size(name *q) { return queueSize((Queue *)q); }   \
+  static inline void name##Close(name *q) { queueClose((Queue *)q); }
+
+#endif
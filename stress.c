@@ -0,0 +1,694 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "queue.c"
+
+/*
+ * Stress harness with offline history checking. Producer and consumer
+ * threads run a seeded random mix of queue operations at full speed and log
+ * every operation, with its start and end time, into a log of their own, so
+ * recording shares no cache line and takes no lock. Once a run is over the
+ * merged history is checked:
+ *
+ *   - every item is dequeued exactly once, and nothing else is
+ *   - every consumer sees each producer's items in the order they were made
+ *   - FIFO: if enqueue(a) ended before enqueue(b) started, dequeue(b) did
+ *     not end before dequeue(a) started (skipped for the sharded queue,
+ *     which is FIFO per shard only)
+ *   - in poll runs, a try dequeue that found nothing did not overlap an
+ *     item that was queued throughout it. Lock-free rings publish slots in
+ *     claim order, so there an enqueue still in flight excuses it.
+ *   - consumers asleep in dequeue() are served in the order they parked
+ *
+ *   gcc -O2 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -pthread stress.c -o stress
+ *   ./stress [all|list|ring|lockfree|spsc|sharded] [items per producer] [seed]
+ *
+ * Exits with status 1 and a description of the first violation found.
+ */
+
+_Static_assert(sizeof(uintptr_t) >= 8, "items encode the producer in the high 32 bits");
+
+#define STRESS_THREADS 4            // Producers and consumers each
+#define STRESS_DEFAULT_ITEMS 250000 // Items per producer
+#define STRESS_CAPACITY 64          // Ring size of the bounded modes; small, so producers block
+#define STRESS_BATCH 8              // Largest batch passed to the Many calls
+#define STRESS_EMPTY_MAX 1000000    // Failed polls logged per consumer, at most
+#define STRESS_WAITERS 8            // Consumers lined up per waiter-order round
+#define STRESS_ROUNDS 200
+
+typedef enum StressMode {
+    STRESS_LIST,
+    STRESS_RING,
+    STRESS_LOCKFREE,
+    STRESS_SPSC,
+    STRESS_SHARDED,
+    STRESS_MODES,
+} StressMode;
+
+static const char *stress_mode_names[STRESS_MODES] = {"list", "ring", "lockfree", "spsc", "sharded"};
+
+typedef enum StressKind {
+    STRESS_ENQUEUE,
+    STRESS_DEQUEUE,
+    STRESS_EMPTY,  // A try dequeue that found nothing
+} StressKind;
+
+typedef struct StressOp {
+    uint64_t start;
+    uint64_t end;
+    uintptr_t item;
+    StressKind kind;
+} StressOp;
+
+/* Operations of one thread; only that thread appends */
+typedef struct StressLog {
+    StressOp *ops;
+    size_t count;
+    size_t capacity;
+    size_t empties;  // Failed polls logged so far
+} StressLog;
+
+typedef struct StressRun {
+    StressMode mode;
+    bool poll;              // Consumers only use the try calls
+    Queue *q;
+    ShardedQueue *sq;
+    size_t producers;
+    size_t consumers;
+    size_t items;           // Per producer
+    uint64_t seed;
+} StressRun;
+
+typedef struct StressThread {
+    StressRun *run;
+    size_t id;
+    uint64_t rng;
+    StressLog log;
+} StressThread;
+
+/* What the checker knows about one item */
+typedef struct StressItem {
+    uint64_t enq_start;
+    uint64_t enq_end;
+    uint64_t deq_start;
+    uint64_t deq_end;
+    bool enqueued;
+    bool dequeued;
+} StressItem;
+
+uint64_t stress_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t stress_rand(uint64_t *state)
+{
+    // xorshift64*, seeded per thread so every run replays the same op mix
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717u;
+}
+
+uintptr_t stress_item(size_t producer, size_t seq)
+{
+    return (uintptr_t)(producer + 1) << 32 | seq;
+}
+
+void stress_log(StressThread *t, StressKind kind, uint64_t start, uint64_t end, uintptr_t item)
+{
+    StressLog *log = &t->log;
+    if (kind == STRESS_EMPTY && log->empties++ >= STRESS_EMPTY_MAX)
+    {
+        return;
+    }
+    if (log->count == log->capacity)
+    {
+        log->capacity = log->capacity > 0 ? 2 * log->capacity : 4096;
+        log->ops = realloc(log->ops, log->capacity * sizeof(StressOp));
+        if (log->ops == NULL)
+        {
+            fprintf(stderr, "out of memory for the operation log\n");
+            exit(2);
+        }
+    }
+    log->ops[log->count++] = (StressOp){start, end, item, kind};
+}
+
+int stress_producer(void *arg)
+{
+    StressThread *t = (StressThread *)arg;
+    StressRun *run = t->run;
+    void *items[STRESS_BATCH];
+
+    for (size_t seq = 1; seq <= run->items;)
+    {
+        uint64_t r = stress_rand(&t->rng);
+        size_t n = 1;
+        if (run->mode != STRESS_SHARDED && r % 5 == 0)
+        {
+            n = 1 + (r >> 8) % STRESS_BATCH;
+            n = n < run->items - seq + 1 ? n : run->items - seq + 1;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            items[i] = (void *)stress_item(t->id, seq + i);
+        }
+
+        uint64_t start = stress_now();
+        if (run->mode == STRESS_SHARDED)
+        {
+            shardedEnqueue(run->sq, items[0]);
+        }
+        else if (n > 1)
+        {
+            queueEnqueueMany(run->q, items, n);
+        }
+        else if (r % 5 > 2 || !queueTryEnqueue(run->q, items[0]))
+        {
+            queueEnqueue(run->q, items[0]);
+        }
+        uint64_t end = stress_now();
+
+        for (size_t i = 0; i < n; i++)
+        {
+            stress_log(t, STRESS_ENQUEUE, start, end, (uintptr_t)items[i]);
+        }
+        seq += n;
+    }
+    return 0;
+}
+
+/**
+ * The sharded queue has no batch calls; otherwise the same as below.
+ */
+void stress_sharded_consumer(StressThread *t)
+{
+    StressRun *run = t->run;
+
+    for (;;)
+    {
+        uint64_t r = stress_rand(&t->rng);
+        bool closed = shardedQueueIsClosed(run->sq);
+        uint64_t start = stress_now();
+        void *item;
+
+        if (!run->poll && r % 2 == 0)
+        {
+            item = shardedDequeue(run->sq);
+            if (item == NULL)
+            {
+                break;
+            }
+        }
+        else if (!shardedTryDequeue(run->sq, &item))
+        {
+            if (closed)
+            {
+                break;
+            }
+            if (run->poll)
+            {
+                stress_log(t, STRESS_EMPTY, start, stress_now(), 0);
+            }
+            thrd_yield();
+            continue;
+        }
+        stress_log(t, STRESS_DEQUEUE, start, stress_now(), (uintptr_t)item);
+    }
+}
+
+int stress_consumer(void *arg)
+{
+    StressThread *t = (StressThread *)arg;
+    StressRun *run = t->run;
+    void *items[STRESS_BATCH];
+
+    if (run->mode == STRESS_SHARDED)
+    {
+        stress_sharded_consumer(t);
+        return 0;
+    }
+
+    // The queue is closed once every producer is done; after that an empty
+    // queue stays empty
+    for (;;)
+    {
+        uint64_t r = stress_rand(&t->rng);
+        size_t max = r % 3 == 0 ? 1 + (r >> 8) % STRESS_BATCH : 1;
+        bool closed = queueIsClosed(run->q);
+        uint64_t start = stress_now();
+        size_t n;
+
+        if (!run->poll && r % 4 < 3)
+        {
+            n = queueDequeueMany(run->q, items, max);
+            if (n == 0)
+            {
+                break;
+            }
+        }
+        else
+        {
+            n = max > 1 ? queueTryDequeueMany(run->q, items, max)
+                        : queueTryDequeue(run->q, &items[0]);
+            if (n == 0)
+            {
+                if (closed)
+                {
+                    break;
+                }
+                if (run->poll)
+                {
+                    stress_log(t, STRESS_EMPTY, start, stress_now(), 0);
+                }
+                thrd_yield();
+                continue;
+            }
+        }
+
+        uint64_t end = stress_now();
+        for (size_t i = 0; i < n; i++)
+        {
+            stress_log(t, STRESS_DEQUEUE, start, end, (uintptr_t)items[i]);
+        }
+    }
+    return 0;
+}
+
+/* -------------------Checks ----------------*/
+
+static StressItem *check_items;  // Indexed by producer * items + seq - 1
+
+int by_enq_end(const void *a, const void *b)
+{
+    uint64_t x = check_items[*(const size_t *)a].enq_end;
+    uint64_t y = check_items[*(const size_t *)b].enq_end;
+    return x < y ? -1 : x > y;
+}
+
+int by_enq_start(const void *a, const void *b)
+{
+    uint64_t x = check_items[*(const size_t *)a].enq_start;
+    uint64_t y = check_items[*(const size_t *)b].enq_start;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Number of entries in order (sorted by key) whose key is below limit
+ */
+size_t count_below(const size_t *order, size_t n, bool by_end, uint64_t limit)
+{
+    size_t lo = 0;
+    size_t hi = n;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        StressItem *it = &check_items[order[mid]];
+        if ((by_end ? it->enq_end : it->enq_start) < limit)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool stress_fail(const char *mode, const char *what, uintptr_t a, uintptr_t b)
+{
+    printf("%s: %s (items %lx, %lx)\n", mode, what, (unsigned long)a, (unsigned long)b);
+    return false;
+}
+
+/**
+ * Check the merged history of a run
+ * @return True if no violation was found
+ */
+bool stress_check(StressRun *run, StressThread *producers, StressThread *consumers)
+{
+    const char *name = stress_mode_names[run->mode];
+    size_t total = run->producers * run->items;
+    bool ok = true;
+
+    check_items = calloc(total, sizeof(StressItem));
+    size_t *last_seq = calloc(run->producers, sizeof(size_t));
+    for (size_t p = 0; p < run->producers; p++)
+    {
+        StressLog *log = &producers[p].log;
+        for (size_t i = 0; i < log->count; i++)
+        {
+            StressItem *it = &check_items[p * run->items + i];
+            it->enq_start = log->ops[i].start;
+            it->enq_end = log->ops[i].end;
+            it->enqueued = true;
+        }
+    }
+
+    // Exactly once, and per-producer order as seen by every consumer
+    for (size_t c = 0; c < run->consumers && ok; c++)
+    {
+        StressLog *log = &consumers[c].log;
+        memset(last_seq, 0, run->producers * sizeof(size_t));
+        for (size_t i = 0; i < log->count && ok; i++)
+        {
+            StressOp *op = &log->ops[i];
+            if (op->kind != STRESS_DEQUEUE)
+            {
+                continue;
+            }
+            size_t p = (op->item >> 32) - 1;
+            size_t seq = op->item & 0xffffffffu;
+            if (p >= run->producers || seq == 0 || seq > run->items)
+            {
+                ok = stress_fail(name, "dequeued an item nobody enqueued", op->item, 0);
+                break;
+            }
+            StressItem *it = &check_items[p * run->items + seq - 1];
+            if (it->dequeued)
+            {
+                ok = stress_fail(name, "item dequeued twice", op->item, 0);
+            }
+            else if (seq < last_seq[p])
+            {
+                ok = stress_fail(name, "producer order broken",
+                                 stress_item(p, last_seq[p]), op->item);
+            }
+            it->dequeued = true;
+            it->deq_start = op->start;
+            it->deq_end = op->end;
+            last_seq[p] = seq;
+        }
+    }
+    for (size_t i = 0; i < total && ok; i++)
+    {
+        if (!check_items[i].dequeued)
+        {
+            ok = stress_fail(name, "item lost", stress_item(i / run->items, i % run->items + 1), 0);
+        }
+    }
+
+    size_t *by_end = malloc(total * sizeof(size_t));
+    size_t *by_start = malloc(total * sizeof(size_t));
+    for (size_t i = 0; i < total; i++)
+    {
+        by_end[i] = i;
+        by_start[i] = i;
+    }
+    qsort(by_end, total, sizeof(size_t), by_enq_end);
+    qsort(by_start, total, sizeof(size_t), by_enq_start);
+
+    // FIFO: sweep b by enqueue start, keeping the latest dequeue start of
+    // every a whose enqueue ended before b's started
+    if (ok && run->mode != STRESS_SHARDED)
+    {
+        size_t a = 0;
+        size_t latest = SIZE_MAX;
+        for (size_t k = 0; k < total && ok; k++)
+        {
+            StressItem *b = &check_items[by_start[k]];
+            for (; a < total && check_items[by_end[a]].enq_end < b->enq_start; a++)
+            {
+                if (latest == SIZE_MAX || check_items[by_end[a]].deq_start > check_items[latest].deq_start)
+                {
+                    latest = by_end[a];
+                }
+            }
+            if (latest != SIZE_MAX && check_items[latest].deq_start > b->deq_end)
+            {
+                ok = stress_fail(name, "dequeued out of FIFO order",
+                                 stress_item(latest / run->items, latest % run->items + 1),
+                                 stress_item(by_start[k] / run->items, by_start[k] % run->items + 1));
+            }
+        }
+    }
+
+    // Failed polls: prefix maxima of the dequeue start over items sorted by
+    // enqueue end, and of the enqueue end over items sorted by enqueue start
+    if (ok && run->poll)
+    {
+        uint64_t *deq_max = malloc(total * sizeof(uint64_t));
+        uint64_t *enq_max = malloc(total * sizeof(uint64_t));
+        for (size_t k = 0; k < total; k++)
+        {
+            uint64_t d = check_items[by_end[k]].deq_start;
+            uint64_t e = check_items[by_start[k]].enq_end;
+            deq_max[k] = k > 0 && deq_max[k - 1] > d ? deq_max[k - 1] : d;
+            enq_max[k] = k > 0 && enq_max[k - 1] > e ? enq_max[k - 1] : e;
+        }
+        bool lock_free = run->mode == STRESS_LOCKFREE || run->mode == STRESS_SPSC;
+        for (size_t c = 0; c < run->consumers && ok; c++)
+        {
+            StressLog *log = &consumers[c].log;
+            for (size_t i = 0; i < log->count && ok; i++)
+            {
+                StressOp *op = &log->ops[i];
+                if (op->kind != STRESS_EMPTY)
+                {
+                    continue;
+                }
+                size_t queued = count_below(by_end, total, true, op->start);
+                if (queued == 0 || deq_max[queued - 1] <= op->end)
+                {
+                    continue;  // Nothing was queued throughout the poll
+                }
+                size_t started = count_below(by_start, total, false, op->end);
+                if (lock_free && started > 0 && enq_max[started - 1] > op->start)
+                {
+                    continue;  // An enqueue was in flight
+                }
+                ok = stress_fail(name, "try dequeue missed a queued item", 0, 0);
+            }
+        }
+        free(deq_max);
+        free(enq_max);
+    }
+
+    free(by_end);
+    free(by_start);
+    free(last_seq);
+    free(check_items);
+    return ok;
+}
+
+/* -------------------Runs ----------------*/
+
+bool stress_history(StressMode mode, bool poll, size_t items, uint64_t seed)
+{
+    StressRun run = {
+        .mode = mode,
+        .poll = poll,
+        .producers = mode == STRESS_SPSC ? 1 : STRESS_THREADS,
+        .consumers = mode == STRESS_SPSC ? 1 : STRESS_THREADS,
+        .items = items,
+        .seed = seed,
+    };
+    StressThread producers[STRESS_THREADS] = {0};
+    StressThread consumers[STRESS_THREADS] = {0};
+    thrd_t producer_ids[STRESS_THREADS];
+    thrd_t consumer_ids[STRESS_THREADS];
+
+    switch (mode)
+    {
+    case STRESS_RING:
+        run.q = queueCreateBounded(STRESS_CAPACITY);
+        break;
+    case STRESS_LOCKFREE:
+        run.q = queueCreateLockFree(STRESS_CAPACITY);
+        break;
+    case STRESS_SPSC:
+        run.q = queueCreateSpsc(STRESS_CAPACITY);
+        break;
+    case STRESS_SHARDED:
+        run.sq = shardedQueueCreate(STRESS_THREADS);
+        break;
+    default:
+        run.q = queueCreate();
+        break;
+    }
+
+    uint64_t start = stress_now();
+    for (size_t i = 0; i < run.consumers; i++)
+    {
+        consumers[i] = (StressThread){.run = &run, .id = i, .rng = seed * 2 + 1 + i * 7919};
+        thrd_create(&consumer_ids[i], stress_consumer, &consumers[i]);
+    }
+    for (size_t i = 0; i < run.producers; i++)
+    {
+        producers[i] = (StressThread){.run = &run, .id = i, .rng = seed * 2 + 1 + (i + 64) * 7919};
+        thrd_create(&producer_ids[i], stress_producer, &producers[i]);
+    }
+    for (size_t i = 0; i < run.producers; i++)
+    {
+        thrd_join(producer_ids[i], NULL);
+    }
+    if (run.q != NULL)
+    {
+        queueClose(run.q);
+    }
+    else
+    {
+        shardedQueueClose(run.sq);
+    }
+    for (size_t i = 0; i < run.consumers; i++)
+    {
+        thrd_join(consumer_ids[i], NULL);
+    }
+    double elapsed = (stress_now() - start) / 1e9;
+
+    bool ok = stress_check(&run, producers, consumers);
+    if (ok && run.q != NULL && (queueSize(run.q) != 0 || queueWaiting(run.q) != 0))
+    {
+        ok = stress_fail(stress_mode_names[mode], "queue not empty at the end", 0, 0);
+    }
+    printf("%-9s %-7s %zu:%-3zu %10zu items %8.2f Mops/s  %s\n", stress_mode_names[mode],
+           poll ? "poll" : "mixed", run.producers, run.consumers, run.producers * items,
+           2 * run.producers * items / elapsed / 1e6, ok ? "ok" : "FAILED");
+
+    for (size_t i = 0; i < STRESS_THREADS; i++)
+    {
+        free(producers[i].log.ops);
+        free(consumers[i].log.ops);
+    }
+    queueDestroy(run.q);
+    shardedQueueDestroy(run.sq);
+    return ok;
+}
+
+typedef struct StressWaiter {
+    Queue *q;
+    atomic_int go;  // 1: dequeue once, -1: exit, 0: idle
+    void *item;
+} StressWaiter;
+
+int stress_waiter(void *arg)
+{
+    StressWaiter *w = (StressWaiter *)arg;
+    for (;;)
+    {
+        int go;
+        while ((go = atomic_load(&w->go)) == 0)
+        {
+            thrd_yield();
+        }
+        if (go < 0)
+        {
+            return 0;
+        }
+        w->item = queueDequeue(w->q);
+        atomic_store(&w->go, 0);
+    }
+}
+
+/**
+ * Line consumers up in dequeue() one at a time, then check that items are
+ * handed out in the order they parked in
+ */
+bool stress_waiter_order(StressMode mode)
+{
+    Queue *q = mode == STRESS_RING       ? queueCreateBounded(STRESS_CAPACITY)
+               : mode == STRESS_LOCKFREE ? queueCreateLockFree(STRESS_CAPACITY)
+                                         : queueCreate();
+    StressWaiter waiters[STRESS_WAITERS];
+    thrd_t ids[STRESS_WAITERS];
+    void *items[STRESS_WAITERS];
+    bool ok = true;
+
+    for (size_t i = 0; i < STRESS_WAITERS; i++)
+    {
+        waiters[i].q = q;
+        atomic_init(&waiters[i].go, 0);
+        thrd_create(&ids[i], stress_waiter, &waiters[i]);
+    }
+
+    uint64_t start = stress_now();
+    for (size_t round = 0; round < STRESS_ROUNDS && ok; round++)
+    {
+        // Rotate who parks first so order is not just thread creation order
+        for (size_t k = 0; k < STRESS_WAITERS; k++)
+        {
+            StressWaiter *w = &waiters[(round + k) % STRESS_WAITERS];
+            atomic_store(&w->go, 1);
+            while (queueWaiting(q) < k + 1)
+            {
+                thrd_yield();
+            }
+            items[k] = (void *)stress_item(round, k + 1);
+        }
+        if (round % 2 == 0)
+        {
+            queueEnqueueMany(q, items, STRESS_WAITERS);
+        }
+        else
+        {
+            for (size_t k = 0; k < STRESS_WAITERS; k++)
+            {
+                queueEnqueue(q, items[k]);
+            }
+        }
+        for (size_t k = 0; k < STRESS_WAITERS && ok; k++)
+        {
+            StressWaiter *w = &waiters[(round + k) % STRESS_WAITERS];
+            while (atomic_load(&w->go) != 0)
+            {
+                thrd_yield();
+            }
+            if (w->item != items[k])
+            {
+                ok = stress_fail(stress_mode_names[mode], "waiter served out of order",
+                                 (uintptr_t)items[k], (uintptr_t)w->item);
+            }
+        }
+    }
+    double elapsed = (stress_now() - start) / 1e9;
+
+    // Release anyone still parked after a failure
+    queueClose(q);
+    for (size_t i = 0; i < STRESS_WAITERS; i++)
+    {
+        while (atomic_load(&waiters[i].go) != 0)
+        {
+            thrd_yield();
+        }
+        atomic_store(&waiters[i].go, -1);
+        thrd_join(ids[i], NULL);
+    }
+    queueDestroy(q);
+
+    printf("%-9s %-7s %zu waiters %6d rounds %10.0f rounds/s  %s\n", stress_mode_names[mode],
+           "waiters", (size_t)STRESS_WAITERS, STRESS_ROUNDS, STRESS_ROUNDS / elapsed,
+           ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    size_t items = argc > 2 ? strtoul(argv[2], NULL, 10) : STRESS_DEFAULT_ITEMS;
+    uint64_t seed = argc > 3 ? strtoull(argv[3], NULL, 10) : 1;
+    bool ok = true;
+
+    if (items == 0 || items > 0xffffffffu)
+    {
+        fprintf(stderr, "items per producer must be in [1, 2^32)\n");
+        return 2;
+    }
+    for (int mode = 0; mode < STRESS_MODES; mode++)
+    {
+        if (argc > 1 && strcmp(argv[1], "all") != 0 && strcmp(argv[1], stress_mode_names[mode]) != 0)
+        {
+            continue;
+        }
+        ok = stress_history(mode, false, items, seed) && ok;
+        ok = stress_history(mode, true, items, seed) && ok;
+        // Waiter order needs several consumers on one Queue
+        if (mode != STRESS_SPSC && mode != STRESS_SHARDED)
+        {
+            ok = stress_waiter_order(mode) && ok;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <poll.h>
 #include "queue.c"
 
 #define NUM_OPERATIONS 10
@@ -120,6 +121,2002 @@ void test_size()
     printf("size test passed.\n");
 }
 
+void test_initQueueReserve()
+{
+    printf("=== Testing initQueueReserve ===\n");
+
+    initQueueReserve(16);
+
+    int items[MAX_SIZE];
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        items[i] = i;
+    }
+
+    // Go past the reserved nodes a few times so the pool has to grow and recycle
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i = 0; i < MAX_SIZE; i++)
+        {
+            enqueue(&items[i]);
+        }
+        assert(size() == MAX_SIZE);
+        for (int i = 0; i < MAX_SIZE; i++)
+        {
+            int *item = (int *)dequeue();
+            assert(*item == items[i]);
+        }
+        assert(size() == 0);
+    }
+    assert(visited() == 3 * MAX_SIZE);
+
+    destroyQueue();
+
+    printf("initQueueReserve test passed.\n");
+}
+
+int enqueue_one(void *arg)
+{
+    enqueue(arg);
+    return 0;
+}
+
+void test_bounded_queue()
+{
+    printf("=== Testing bounded queue ===\n");
+
+    // Capacity is rounded up to the next power of two
+    assert(initQueueBounded(5));
+
+    int items[MAX_SIZE];
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        items[i] = i;
+    }
+
+    // Fill the ring, the next tryEnqueue must report it as full
+    for (int i = 0; i < 8; i++)
+    {
+        assert(tryEnqueue(&items[i]));
+    }
+    assert(!tryEnqueue(&items[8]));
+    assert(size() == 8);
+
+    // Keep the ring half full while the indices wrap around many times
+    void *item;
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        int *dequeued = (int *)dequeue();
+        assert(*dequeued == i % 8);
+        if (i % 8 == 7)
+        {
+            for (int j = 0; j < 8; j++)
+            {
+                enqueue(&items[j]);
+            }
+        }
+    }
+    while (tryDequeue(&item))
+    {
+    }
+
+    // A producer on a full ring blocks until a consumer makes room
+    for (int i = 0; i < 8; i++)
+    {
+        enqueue(&items[i]);
+    }
+    thrd_t producer;
+    thrd_create(&producer, enqueue_one, &items[8]);
+    usleep(100000);
+    assert(size() == 8);
+    assert(*(int *)dequeue() == 0);
+    thrd_join(producer, NULL);
+    assert(size() == 8);
+    for (int i = 1; i <= 8; i++)
+    {
+        assert(tryDequeue(&item));
+        assert(*(int *)item == i);
+    }
+    assert(!tryDequeue(&item));
+
+    destroyQueue();
+
+    printf("bounded queue test passed.\n");
+}
+
+int dequeue_many_thread(void *arg)
+{
+    void **items = (void **)arg;
+    return (int)dequeueMany(items, 4);
+}
+
+void test_batch_operations()
+{
+    printf("=== Testing batch operations ===\n");
+
+    int items[MAX_SIZE];
+    void *ptrs[MAX_SIZE];
+    void *out[MAX_SIZE];
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        items[i] = i;
+        ptrs[i] = &items[i];
+    }
+
+    // List mode
+    initQueue();
+    assert(tryDequeueMany(out, MAX_SIZE) == 0);
+    enqueueMany(ptrs, MAX_SIZE);
+    assert(size() == MAX_SIZE);
+    assert(visited() == MAX_SIZE);
+    assert(tryDequeueMany(out, 10) == 10);
+    assert(dequeueMany(out + 10, MAX_SIZE) == MAX_SIZE - 10);
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        assert(*(int *)out[i] == i);
+    }
+    assert(size() == 0);
+
+    // Blocked batch consumers are served in arrival order
+    void *first[4];
+    void *second[4];
+    thrd_t consumers[2];
+    thrd_create(&consumers[0], dequeue_many_thread, first);
+    usleep(100000);
+    thrd_create(&consumers[1], dequeue_many_thread, second);
+    usleep(100000);
+    assert(waiting() == 2);
+    enqueueMany(ptrs, 8);
+    int taken[2];
+    thrd_join(consumers[0], &taken[0]);
+    thrd_join(consumers[1], &taken[1]);
+    assert(taken[0] == 4 && taken[1] == 4);
+    for (int i = 0; i < 4; i++)
+    {
+        assert(*(int *)first[i] == i);
+        assert(*(int *)second[i] == i + 4);
+    }
+    assert(waiting() == 0);
+    destroyQueue();
+
+    // Ring mode wraps batches around the end of the ring
+    assert(initQueueBounded(8));
+    for (int round = 0; round < 10; round++)
+    {
+        enqueueMany(ptrs, 5);
+        assert(tryDequeueMany(out, MAX_SIZE) == 5);
+        for (int i = 0; i < 5; i++)
+        {
+            assert(*(int *)out[i] == i);
+        }
+    }
+    assert(visited() == 50);
+    destroyQueue();
+
+    printf("batch operations test passed.\n");
+}
+
+#define LF_ITEMS_PER_THREAD 20000
+#define LF_THREADS 4
+
+int lockfree_producer(void *arg)
+{
+    int *items = (int *)arg;
+    for (int i = 0; i < LF_ITEMS_PER_THREAD; i++)
+    {
+        enqueue(&items[i]);
+    }
+    return 0;
+}
+
+int lockfree_consumer(void *arg)
+{
+    long *sum = (long *)arg;
+    for (int i = 0; i < LF_ITEMS_PER_THREAD; i++)
+    {
+        void *item;
+        // Mix the lock-free and the sleeping path
+        if (i % 2 == 0 || !tryDequeue(&item))
+        {
+            item = dequeue();
+        }
+        *sum += *(int *)item;
+    }
+    return 0;
+}
+
+void test_lockfree_queue()
+{
+    printf("=== Testing lock-free queue ===\n");
+
+    static int items[LF_ITEMS_PER_THREAD];
+    for (int i = 0; i < LF_ITEMS_PER_THREAD; i++)
+    {
+        items[i] = i;
+    }
+
+    // Single-threaded FIFO behaviour and capacity
+    assert(initQueueLockFree(8));
+    void *item;
+    assert(!tryDequeue(&item));
+    for (int i = 0; i < 8; i++)
+    {
+        assert(tryEnqueue(&items[i]));
+    }
+    assert(!tryEnqueue(&items[8]));
+    assert(size() == 8);
+    for (int i = 0; i < 8; i++)
+    {
+        assert(tryDequeue(&item));
+        assert(*(int *)item == i);
+    }
+    assert(size() == 0);
+    destroyQueue();
+
+    // Sleeping consumers are served in arrival order
+    initQueueLockFree(64);
+    thrd_t consumers[NUM_THREADS];
+    int dequeue_order[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++)
+    {
+        thrd_create(&consumers[i], consumer_thread, &dequeue_order[i]);
+        usleep(10000);
+    }
+    assert(waiting() == NUM_THREADS);
+    for (int i = 0; i < NUM_THREADS; i++)
+    {
+        enqueue(&items[i + 1]);
+    }
+    for (int i = 0; i < NUM_THREADS; i++)
+    {
+        thrd_join(consumers[i], NULL);
+        assert(dequeue_order[i] == i + 1);
+    }
+    assert(waiting() == 0);
+    destroyQueue();
+
+    // Many producers and consumers through a small ring, so both sides sleep
+    initQueueLockFree(16);
+    thrd_t producers[LF_THREADS];
+    thrd_t lf_consumers[LF_THREADS];
+    long sums[LF_THREADS] = {0};
+    for (int i = 0; i < LF_THREADS; i++)
+    {
+        thrd_create(&lf_consumers[i], lockfree_consumer, &sums[i]);
+        thrd_create(&producers[i], lockfree_producer, items);
+    }
+    long total = 0;
+    for (int i = 0; i < LF_THREADS; i++)
+    {
+        thrd_join(producers[i], NULL);
+        thrd_join(lf_consumers[i], NULL);
+        total += sums[i];
+    }
+    assert(total == (long)LF_THREADS * LF_ITEMS_PER_THREAD * (LF_ITEMS_PER_THREAD - 1) / 2);
+    assert(size() == 0);
+    assert(visited() == LF_THREADS * LF_ITEMS_PER_THREAD);
+    assert(waiting() == 0);
+    destroyQueue();
+
+    printf("lock-free queue test passed.\n");
+}
+
+int pipeline_stage(void *arg)
+{
+    // Move every item from the first queue to the second
+    Queue **stage = (Queue **)arg;
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        queueEnqueue(stage[1], queueDequeue(stage[0]));
+    }
+    return 0;
+}
+
+void test_queue_instances()
+{
+    printf("=== Testing queue instances ===\n");
+
+    int items[MAX_SIZE];
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        items[i] = i;
+    }
+
+    // Instances do not share items or counters with each other or the default queue
+    initQueue();
+    Queue *a = queueCreate();
+    Queue *b = queueCreateBounded(16);
+    Queue *c = queueCreateLockFree(16);
+    assert(a != NULL && b != NULL && c != NULL);
+    enqueue(&items[0]);
+    queueEnqueue(a, &items[1]);
+    queueEnqueue(a, &items[2]);
+    assert(size() == 1 && queueSize(a) == 2 && queueSize(b) == 0);
+    assert(visited() == 1 && queueVisited(a) == 2);
+
+    void *item;
+    assert(!queueTryDequeue(b, &item));
+    assert(*(int *)queueDequeue(a) == 1);
+    assert(*(int *)dequeue() == 0);
+
+    // Chain the instances into a pipeline: a -> b -> c
+    Queue *first[2] = {a, b};
+    Queue *second[2] = {b, c};
+    thrd_t stages[2];
+    thrd_create(&stages[0], pipeline_stage, first);
+    thrd_create(&stages[1], pipeline_stage, second);
+    for (int i = 3; i < MAX_SIZE + 2; i++)
+    {
+        queueEnqueue(a, &items[i % MAX_SIZE]);
+    }
+    for (int i = 2; i < MAX_SIZE + 2; i++)
+    {
+        assert(*(int *)queueDequeue(c) == i % MAX_SIZE);
+    }
+    thrd_join(stages[0], NULL);
+    thrd_join(stages[1], NULL);
+    assert(queueSize(a) == 0 && queueSize(b) == 0 && queueSize(c) == 0);
+    assert(queueWaiting(a) == 0 && queueWaiting(c) == 0);
+
+    queueDestroy(a);
+    queueDestroy(b);
+    queueDestroy(c);
+    destroyQueue();
+
+    printf("queue instances test passed.\n");
+}
+
+#define SHARDS 4
+
+int sharded_producer(void *arg)
+{
+    ShardedQueue *sq = (ShardedQueue *)arg;
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        int *item = malloc(sizeof(int));
+        *item = i;
+        shardedEnqueue(sq, item);
+    }
+    return 0;
+}
+
+typedef struct
+{
+    ShardedQueue *sq;
+    long sum;
+} ShardedConsumerArg;
+
+int sharded_consumer(void *arg)
+{
+    ShardedConsumerArg *consumer = (ShardedConsumerArg *)arg;
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        int *item = (int *)shardedDequeue(consumer->sq);
+        consumer->sum += *item;
+        free(item);
+    }
+    return 0;
+}
+
+int sharded_close_consumer(void *arg)
+{
+    ShardedConsumerArg *consumer = (ShardedConsumerArg *)arg;
+    while (shardedDequeue(consumer->sq) != NULL)
+    {
+        consumer->sum++;
+    }
+    return 0;
+}
+
+void test_sharded_queue()
+{
+    printf("=== Testing sharded queue ===\n");
+
+    ShardedQueue *sq = shardedQueueCreate(SHARDS);
+    assert(sq != NULL);
+
+    // A single thread always uses the same home shard, so it sees FIFO order
+    int items[] = {1, 2, 3};
+    void *item;
+    assert(!shardedTryDequeue(sq, &item));
+    for (int i = 0; i < 3; i++)
+    {
+        shardedEnqueue(sq, &items[i]);
+    }
+    assert(shardedSize(sq) == 3);
+    for (int i = 0; i < 3; i++)
+    {
+        assert(shardedTryDequeue(sq, &item));
+        assert(*(int *)item == items[i]);
+    }
+
+    // Consumers start first and sleep, then have to steal from producer shards
+    thrd_t producers[SHARDS];
+    thrd_t consumers[SHARDS];
+    ShardedConsumerArg args[SHARDS];
+    for (int i = 0; i < SHARDS; i++)
+    {
+        args[i].sq = sq;
+        args[i].sum = 0;
+        thrd_create(&consumers[i], sharded_consumer, &args[i]);
+    }
+    usleep(10000);
+    for (int i = 0; i < SHARDS; i++)
+    {
+        thrd_create(&producers[i], sharded_producer, sq);
+    }
+    for (int i = 0; i < SHARDS; i++)
+    {
+        thrd_join(producers[i], NULL);
+    }
+    // Every consumer takes MAX_SIZE items from any shard, only the total is fixed
+    long total = 0;
+    for (int i = 0; i < SHARDS; i++)
+    {
+        thrd_join(consumers[i], NULL);
+        total += args[i].sum;
+    }
+    assert(total == (long)SHARDS * MAX_SIZE * (MAX_SIZE - 1) / 2);
+    assert(shardedSize(sq) == 0);
+
+    // Closing wakes the sleeping consumers once the queued items are taken
+    for (int i = 0; i < SHARDS; i++)
+    {
+        args[i].sum = 0;
+        thrd_create(&consumers[i], sharded_close_consumer, &args[i]);
+    }
+    usleep(10000);
+    for (int i = 0; i < 3; i++)
+    {
+        shardedEnqueue(sq, &items[i]);
+    }
+    assert(!shardedQueueIsClosed(sq));
+    shardedQueueClose(sq);
+    assert(shardedQueueIsClosed(sq));
+    total = 0;
+    for (int i = 0; i < SHARDS; i++)
+    {
+        thrd_join(consumers[i], NULL);
+        total += args[i].sum;
+    }
+    assert(total == 3);
+    assert(shardedDequeue(sq) == NULL);
+    shardedEnqueue(sq, &items[0]);
+    assert(shardedSize(sq) == 0);
+
+    shardedQueueDestroy(sq);
+
+    // Destroying closes as well, so consumers still asleep return NULL
+    sq = shardedQueueCreate(SHARDS);
+    assert(sq != NULL);
+    for (int i = 0; i < SHARDS; i++)
+    {
+        args[i].sq = sq;
+        args[i].sum = 0;
+        thrd_create(&consumers[i], sharded_close_consumer, &args[i]);
+    }
+    while (shardedWaiting(sq) < SHARDS)
+    {
+        thrd_yield();
+    }
+    shardedQueueDestroy(sq);
+    for (int i = 0; i < SHARDS; i++)
+    {
+        thrd_join(consumers[i], NULL);
+        assert(args[i].sum == 0);
+    }
+
+    printf("sharded queue test passed.\n");
+}
+
+void test_targeted_wakeup()
+{
+    printf("=== Testing targeted wakeup ===\n");
+
+    initQueue();
+
+    int items[NUM_THREADS];
+    thrd_t consumers[NUM_THREADS];
+    int dequeue_order[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++)
+    {
+        items[i] = i + 1;
+        thrd_create(&consumers[i], consumer_thread, &dequeue_order[i]);
+        usleep(10000);
+    }
+    assert(waiting() == NUM_THREADS);
+
+    // Every enqueue serves exactly one waiter before it returns
+    for (int i = 0; i < NUM_THREADS; i++)
+    {
+        enqueue(&items[i]);
+        assert(waiting() == (size_t)(NUM_THREADS - i - 1));
+        assert(size() == 0);
+    }
+    for (int i = 0; i < NUM_THREADS; i++)
+    {
+        thrd_join(consumers[i], NULL);
+        assert(dequeue_order[i] == i + 1);
+    }
+    assert(visited() == NUM_THREADS);
+
+    // Items went straight to the sleeping consumers, no node was ever allocated
+    assert(defaultQueue.pool.chunks == NULL);
+
+    destroyQueue();
+
+    printf("targeted wakeup test passed.\n");
+}
+
+int timed_consumer_thread(void *arg)
+{
+    int *dequeue_order = (int *)arg;
+    struct timespec timeout = {0, 100000000}; // 100 milliseconds
+    void *item;
+
+    *dequeue_order = dequeueFor(&item, &timeout) ? *(int *)item : 0;
+    return 0;
+}
+
+void test_timed_dequeue()
+{
+    printf("=== Testing timed dequeue ===\n");
+
+    initQueue();
+
+    // Nothing arrives, the deadline passes
+    void *item;
+    struct timespec timeout = {0, 50000000}; // 50 milliseconds
+    assert(!dequeueFor(&item, &timeout));
+    assert(waiting() == 0);
+
+    struct timespec deadline;
+    timespec_get(&deadline, TIME_UTC);
+    assert(!dequeueUntil(&item, &deadline));
+
+    // An item that is already there is returned without waiting
+    int items[] = {1, 2, 3};
+    enqueue(&items[0]);
+    assert(dequeueFor(&item, &timeout));
+    assert(*(int *)item == 1);
+
+    // The middle waiter times out, the other two keep their FIFO order
+    thrd_t consumers[3];
+    int dequeue_order[3];
+    thrd_create(&consumers[0], consumer_thread, &dequeue_order[0]);
+    usleep(10000);
+    thrd_create(&consumers[1], timed_consumer_thread, &dequeue_order[1]);
+    usleep(10000);
+    thrd_create(&consumers[2], consumer_thread, &dequeue_order[2]);
+    usleep(10000);
+    assert(waiting() == 3);
+
+    thrd_join(consumers[1], NULL);
+    assert(dequeue_order[1] == 0);
+    assert(waiting() == 2);
+
+    enqueue(&items[1]);
+    enqueue(&items[2]);
+    thrd_join(consumers[0], NULL);
+    thrd_join(consumers[2], NULL);
+    assert(dequeue_order[0] == 2);
+    assert(dequeue_order[2] == 3);
+    assert(waiting() == 0);
+
+    destroyQueue();
+
+    printf("timed dequeue test passed.\n");
+}
+
+void test_spin_then_park()
+{
+    printf("=== Testing spin then park ===\n");
+
+    initQueue();
+
+    // Long parks shrink the spin budget towards its floor
+    size_t budget = atomic_load(&defaultQueue.spin_budget);
+    assert(budget > 0);
+    void *item;
+    struct timespec timeout = {0, 20000000}; // 20 milliseconds
+    for (int i = 0; i < 3; i++)
+    {
+        assert(!dequeueFor(&item, &timeout));
+    }
+    assert(atomic_load(&defaultQueue.spin_budget) < budget);
+
+    // An item found while spinning grows it again
+    budget = atomic_load(&defaultQueue.spin_budget);
+    int value = 1;
+    enqueue(&value);
+    assert(SpinForItems(&defaultQueue));
+    assert(atomic_load(&defaultQueue.spin_budget) > budget);
+    assert(*(int *)dequeue() == 1);
+
+    // With spinning disabled consumers park straight away
+    setSpinLimit(0);
+    assert(atomic_load(&defaultQueue.spin_budget) == 0);
+    assert(!SpinForItems(&defaultQueue));
+
+    destroyQueue();
+
+    printf("spin then park test passed.\n");
+}
+
+int snapshot_monitor(void *arg)
+{
+    atomic_bool *done = (atomic_bool *)arg;
+    int inconsistent = 0;
+    while (!atomic_load(done))
+    {
+        // Nothing is dequeued, so every consistent snapshot has size == visited
+        QueueSnapshot snap = snapshotStats();
+        if (snap.size != snap.visited || snap.waiting != 0)
+        {
+            inconsistent++;
+        }
+    }
+    return inconsistent;
+}
+
+void test_snapshot_stats()
+{
+    printf("=== Testing snapshotStats ===\n");
+
+    initQueue();
+
+    QueueSnapshot snap = snapshotStats();
+    assert(snap.size == 0 && snap.waiting == 0 && snap.visited == 0);
+
+    atomic_bool done = false;
+    thrd_t monitor;
+    thrd_create(&monitor, snapshot_monitor, &done);
+    int items[MAX_SIZE];
+    for (int round = 0; round < 100; round++)
+    {
+        for (int i = 0; i < MAX_SIZE; i++)
+        {
+            enqueue(&items[i]);
+        }
+    }
+    atomic_store(&done, true);
+    int inconsistent;
+    thrd_join(monitor, &inconsistent);
+    assert(inconsistent == 0);
+
+    snap = snapshotStats();
+    assert(snap.size == 100 * MAX_SIZE && snap.visited == 100 * MAX_SIZE);
+    assert(size() == snap.size && visited() == snap.visited && waiting() == 0);
+
+    destroyQueue();
+
+    printf("snapshotStats test passed.\n");
+}
+
+size_t line_of(const void *base, const void *field)
+{
+    return ((const char *)field - (const char *)base) / QUEUE_CACHE_LINE_SIZE;
+}
+
+void test_cache_line_layout()
+{
+    printf("=== Testing cache line layout ===\n");
+
+    Queue *q = queueCreateLockFree(8);
+    assert((uintptr_t)q % QUEUE_CACHE_LINE_SIZE == 0);
+    // Producer, consumer, counters and lock state never share a line
+    assert(line_of(q, &q->enqueue_pos) != line_of(q, &q->dequeue_pos));
+    assert(line_of(q, &q->tail) != line_of(q, &q->head));
+    assert(line_of(q, &q->ring_tail) != line_of(q, &q->counters));
+    assert(line_of(q, &q->ring_head) != line_of(q, &q->counters));
+    assert(line_of(q, &q->dequeue_pos) != line_of(q, &q->mtx));
+    queueDestroy(q);
+
+    ShardedQueue *sq = shardedQueueCreate(3);
+    for (size_t i = 0; i < sq->shard_count; i++)
+    {
+        assert((uintptr_t)sq->shards[i] % QUEUE_CACHE_LINE_SIZE == 0);
+    }
+    shardedQueueDestroy(sq);
+
+    printf("cache line layout test passed.\n");
+}
+
+int priority_consumer(void *arg)
+{
+    *(void **)arg = dequeue();
+    return 0;
+}
+
+void test_priority_enqueue()
+{
+    printf("=== Testing enqueueWithPriority ===\n");
+
+    int items[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+    initQueue();
+    enqueue(&items[0]);
+    enqueue(&items[1]);
+    enqueueWithPriority(&items[2], 3);
+    enqueueWithPriority(&items[3], 100);  // Clamped to QUEUE_PRIORITY_MAX
+    enqueueWithPriority(&items[4], 3);
+    enqueueWithPriority(&items[5], -1);   // Same as plain enqueue
+    enqueueWithPriority(&items[6], QUEUE_PRIORITY_MAX);
+    assert(size() == 7);
+    assert(visited() == 7);
+
+    // Highest level first, FIFO within a level
+    int expected[7] = {3, 6, 2, 4, 0, 1, 5};
+    void *batch[2];
+    assert(dequeueMany(batch, 2) == 2);
+    assert(batch[0] == &items[expected[0]]);
+    assert(batch[1] == &items[expected[1]]);
+    for (int i = 2; i < 7; i++)
+    {
+        assert(dequeue() == &items[expected[i]]);
+    }
+    assert(size() == 0);
+
+    // A sleeping consumer still gets the item directly
+    thrd_t consumer;
+    void *received = NULL;
+    thrd_create(&consumer, priority_consumer, &received);
+    while (waiting() == 0)
+    {
+        thrd_yield();
+    }
+    enqueueWithPriority(&items[7], 5);
+    thrd_join(consumer, NULL);
+    assert(received == &items[7]);
+    assert(size() == 0);
+    destroyQueue();
+
+    // Bounded queues keep strict FIFO order
+    assert(initQueueBounded(4));
+    enqueueWithPriority(&items[0], 0);
+    enqueueWithPriority(&items[1], 5);
+    assert(dequeue() == &items[0]);
+    assert(dequeue() == &items[1]);
+    destroyQueue();
+
+    printf("enqueueWithPriority test passed.\n");
+}
+
+#define CLOSE_THREADS 8
+
+int closed_consumer(void *arg)
+{
+    *(void **)arg = dequeue();
+    return 0;
+}
+
+int closed_queue_consumer(void *arg)
+{
+    void **slot = (void **)arg;
+    *slot = queueDequeue((Queue *)*slot);
+    return 0;
+}
+
+void collect_drained(void **items, size_t count, void *ctx)
+{
+    size_t *calls = (size_t *)ctx;
+    for (size_t i = 0; i < count; i++)
+    {
+        assert(*(int *)items[i] == (int)i + 1);
+    }
+    calls[0]++;
+    calls[1] += count;
+}
+
+void test_close_and_drain()
+{
+    printf("=== Testing closeQueue and drainQueue ===\n");
+
+    // One close releases every blocked consumer
+    int items[5] = {0, 1, 2, 3, 4};
+    void *results[CLOSE_THREADS];
+    thrd_t threads[CLOSE_THREADS];
+    initQueue();
+    for (int i = 0; i < CLOSE_THREADS; i++)
+    {
+        results[i] = &items[0];
+        thrd_create(&threads[i], closed_consumer, &results[i]);
+    }
+    while (waiting() < CLOSE_THREADS)
+    {
+        thrd_yield();
+    }
+    closeQueue();
+    for (int i = 0; i < CLOSE_THREADS; i++)
+    {
+        thrd_join(threads[i], NULL);
+        assert(results[i] == NULL);
+    }
+    assert(waiting() == 0);
+    assert(isQueueClosed());
+    assert(!tryEnqueue(&items[1]));
+    enqueue(&items[1]);
+    assert(size() == 0);
+    destroyQueue();
+
+    // Queued items outlive the close and come back from drain in one batch
+    initQueue();
+    assert(!isQueueClosed());
+    for (int i = 0; i < 5; i++)
+    {
+        enqueue(&items[i]);
+    }
+    closeQueue();
+    assert(dequeue() == &items[0]);
+    size_t calls[2] = {0, 0};
+    assert(drainQueue(collect_drained, calls) == 4);
+    assert(calls[0] == 1 && calls[1] == 4);
+    assert(dequeue() == NULL);
+    void *item;
+    assert(!dequeueFor(&item, &(struct timespec){1, 0}));
+    assert(drainQueue(collect_drained, calls) == 0);
+    assert(calls[0] == 1);
+    destroyQueue();
+
+    // A producer blocked on a full ring gives up
+    assert(initQueueBounded(1));
+    enqueue(&items[0]);
+    thrd_t producer;
+    thrd_create(&producer, enqueue_one, &items[1]);
+    while (defaultQueue.space_waiters == 0)
+    {
+        thrd_yield();
+    }
+    closeQueue();
+    thrd_join(producer, NULL);
+    assert(size() == 1);
+    destroyQueue();
+
+    // Destroying a queue releases its sleepers before freeing anything
+    Queue *q = queueCreateLockFree(4);
+    void *slot = q;
+    thrd_create(&threads[0], closed_queue_consumer, &slot);
+    while (queueWaiting(q) == 0)
+    {
+        thrd_yield();
+    }
+    queueDestroy(q);
+    thrd_join(threads[0], NULL);
+    assert(slot == NULL);
+
+    printf("closeQueue and drainQueue test passed.\n");
+}
+
+bool fd_readable(int fd)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+int notify_producer(void *arg)
+{
+    queueEnqueue((Queue *)arg, arg);
+    return 0;
+}
+
+void test_notify_fd()
+{
+    printf("=== Testing notifyFd ===\n");
+
+    int items[3] = {0, 1, 2};
+    initQueue();
+    enqueue(&items[0]);
+    int fd = notifyFd();
+    assert(fd >= 0);
+    assert(notifyFd() == fd);
+    assert(fd_readable(fd));  // Already holds an item
+    void *item;
+    assert(tryDequeue(&item) && item == &items[0]);
+    assert(!fd_readable(fd));
+    enqueue(&items[1]);
+    enqueue(&items[2]);
+    assert(fd_readable(fd));
+    assert(dequeue() == &items[1]);
+    assert(fd_readable(fd));
+    void *batch[4];
+    assert(tryDequeueMany(batch, 4) == 1);
+    assert(!fd_readable(fd));
+    closeQueue();
+    assert(fd_readable(fd));
+    destroyQueue();
+
+    // Lock-free mode, with the reactor blocked in poll()
+    Queue *q = queueCreateLockFree(8);
+    fd = queueNotifyFd(q);
+    assert(fd >= 0 && !fd_readable(fd));
+    thrd_t producer;
+    thrd_create(&producer, notify_producer, q);
+    struct pollfd pfd = {fd, POLLIN, 0};
+    assert(poll(&pfd, 1, 5000) == 1);
+    thrd_join(producer, NULL);
+    assert(queueTryDequeueMany(q, batch, 4) == 1 && batch[0] == q);
+    assert(!fd_readable(fd));
+    assert(queueTryEnqueue(q, q));
+    assert(fd_readable(fd));
+    assert(queueTryDequeue(q, &item));
+    assert(fd_readable(fd));  // Spurious until a try dequeue sees it empty
+    assert(!queueTryDequeue(q, &item));
+    assert(!fd_readable(fd));
+    queueDestroy(q);
+
+    printf("notifyFd test passed.\n");
+}
+
+int buffered_producer(void *arg)
+{
+    // Never reaches a threshold, so only the exit flush publishes these
+    setProducerFlush(64, 0);
+    for (int i = 0; i < 3; i++)
+    {
+        enqueueBuffered(arg);
+    }
+    return 0;
+}
+
+void test_producer_buffer()
+{
+    printf("=== Testing enqueueBuffered ===\n");
+
+    int items[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+    initQueue();
+    setProducerFlush(64, 0);
+    for (int i = 0; i < 8; i++)
+    {
+        enqueueBuffered(&items[i]);
+    }
+    assert(size() == 0);
+    flushProducer();
+    assert(size() == 8);
+    assert(visited() == 8);
+    for (int i = 0; i < 8; i++)
+    {
+        assert(dequeue() == &items[i]);
+    }
+
+    // Count threshold
+    setProducerFlush(4, 0);
+    for (int i = 0; i < 6; i++)
+    {
+        enqueueBuffered(&items[i]);
+    }
+    assert(size() == 4);
+    flushProducer();
+    assert(size() == 6);
+    void *batch[8];
+    assert(tryDequeueMany(batch, 8) == 6);
+
+    // Time threshold, checked on the next staged item
+    setProducerFlush(64, 1000000L);
+    enqueueBuffered(&items[0]);
+    thrd_sleep(&(struct timespec){0, 5000000}, NULL);
+    enqueueBuffered(&items[1]);
+    assert(size() == 2);
+    assert(tryDequeueMany(batch, 8) == 2);
+
+    // A sleeping consumer does not wait for a threshold
+    setProducerFlush(64, 0);
+    thrd_t consumer;
+    void *received = NULL;
+    thrd_create(&consumer, priority_consumer, &received);
+    while (waiting() == 0)
+    {
+        thrd_yield();
+    }
+    enqueueBuffered(&items[3]);
+    thrd_join(consumer, NULL);
+    assert(received == &items[3]);
+
+    // Switching queues flushes, and so does thread exit
+    Queue *q = queueCreate();
+    queueEnqueueBuffered(q, &items[4]);
+    enqueueBuffered(&items[5]);
+    assert(queueSize(q) == 1);
+    flushProducer();
+    assert(dequeue() == &items[5]);
+    thrd_t producer;
+    thrd_create(&producer, buffered_producer, &items[6]);
+    thrd_join(producer, NULL);
+    assert(size() == 3);
+    assert(visited() == 8 + 6 + 2 + 1 + 1 + 3);
+    queueDestroy(q);
+    destroyQueue();
+    setProducerFlush(PRODUCER_DEFAULT_ITEMS, PRODUCER_DEFAULT_DELAY_NS);
+
+    printf("enqueueBuffered test passed.\n");
+}
+
+void test_queue_stats()
+{
+    printf("=== Testing queueStats ===\n");
+
+    static QueueStats stats;
+    int item = 0;
+    initQueue();
+    enqueue(&item);
+    assert(dequeue() == &item);
+    thrd_t consumer;
+    void *received = NULL;
+    thrd_create(&consumer, priority_consumer, &received);
+    while (waiting() == 0)
+    {
+        thrd_yield();
+    }
+    enqueue(&item);
+    thrd_join(consumer, NULL);
+    destroyQueue();
+
+#ifdef QUEUE_STATS
+    assert(queueStats(&stats));
+    assert(stats.lock_acquires >= 4);
+    assert(stats.hist[QUEUE_STAT_LOCK_WAIT].count == stats.lock_acquires);
+    assert(stats.hist[QUEUE_STAT_LOCK_HOLD].count > 0);
+    assert(stats.hist[QUEUE_STAT_PARK].count > 0);
+    assert(stats.hist[QUEUE_STAT_SOJOURN].count >= 2);
+    assert(stats.hist[QUEUE_STAT_WAKE].count > 0);
+#else
+    assert(!queueStats(&stats));
+    assert(stats.lock_acquires == 0);
+    assert(stats.hist[QUEUE_STAT_SOJOURN].count == 0);
+#endif
+
+    // 90 samples of 1ns and 10 of about 1us
+    QueueHistogram h = {0};
+    h.count = 100;
+    h.max_ns = 1000;
+    h.buckets[1] = 90;
+    h.buckets[StatsBucket(1000)] = 10;
+    assert(queueHistogramPercentile(&h, 50) == 1);
+    assert(queueHistogramPercentile(&h, 90) >= 1000 * 3 / 4);
+    assert(queueHistogramPercentile(&h, 99.9) == 1000);
+
+    printf("queueStats test passed.\n");
+}
+
+typedef struct IntrusiveItem
+{
+    int value;
+    QueueLink link;
+} IntrusiveItem;
+
+int intrusive_consumer(void *arg)
+{
+    void **items = (void **)arg;
+    // Ask for more than will come so the batch waits on its own
+    assert(dequeueMany(items, 4) >= 1);
+    return 0;
+}
+
+void test_intrusive_queue()
+{
+    printf("=== Testing enqueueIntrusive ===\n");
+
+    IntrusiveItem objs[8];
+    QueueLink *links[8];
+    for (int i = 0; i < 8; i++)
+    {
+        objs[i].value = i;
+        links[i] = &objs[i].link;
+    }
+
+    initQueue();
+    enqueueIntrusive(&objs[0].link);
+    enqueue(&objs[1].value);  // Plain items mix with intrusive ones
+    enqueueIntrusiveMany(&links[2], 6);
+    assert(size() == 8);
+    assert(visited() == 8);
+    assert(defaultQueue.pool.chunks != NULL);  // Only the plain item allocated
+
+    QueueLink *link = dequeue();
+    assert(QUEUE_CONTAINER_OF(link, IntrusiveItem, link) == &objs[0]);
+    assert(*(int *)dequeue() == 1);
+    void *batch[8];
+    assert(dequeueMany(batch, 3) == 3);
+    for (int i = 0; i < 3; i++)
+    {
+        assert(QUEUE_CONTAINER_OF(batch[i], IntrusiveItem, link)->value == 2 + i);
+    }
+    assert(tryDequeue(&batch[0]) && batch[0] == links[5]);
+    destroyQueue();
+
+    // A queue of intrusive items never allocates, blocked consumers included
+    initQueue();
+    thrd_t consumer;
+    void *received[4] = {NULL};
+    thrd_create(&consumer, intrusive_consumer, received);
+    while (waiting() == 0)
+    {
+        thrd_yield();
+    }
+    enqueueIntrusiveMany(links, 2);
+    thrd_join(consumer, NULL);
+    assert(received[0] == links[0] && received[1] == links[1]);
+    for (int i = 2; i < 8; i++)
+    {
+        enqueueIntrusive(links[i]);
+    }
+    assert(size() == 6);
+    assert(defaultQueue.pool.chunks == NULL);
+    for (int i = 2; i < 8; i++)
+    {
+        assert(dequeue() == links[i]);
+    }
+    destroyQueue();
+
+    // Ring and lock-free queues store the link pointer itself
+    Queue *q = queueCreateLockFree(8);
+    queueEnqueueIntrusiveMany(q, links, 8);
+    for (int i = 0; i < 8; i++)
+    {
+        assert(queueDequeue(q) == links[i]);
+    }
+    queueDestroy(q);
+
+    printf("enqueueIntrusive test passed.\n");
+}
+
+int reserved_consumer(void *arg)
+{
+    void **slot = (void **)arg;
+    *slot = queueDequeue((Queue *)*slot);
+    return 0;
+}
+
+void test_try_dequeue_reservations()
+{
+    printf("=== Testing tryDequeue reservations ===\n");
+
+    int items[3] = {0, 1, 2};
+    Queue *q = queueCreateLockFree(8);
+    void *slot = q;
+    thrd_t consumer;
+    thrd_create(&consumer, reserved_consumer, &slot);
+    while (queueWaiting(q) == 0)
+    {
+        thrd_yield();
+    }
+
+    // Published but not yet handed over: the sleeper holds a ticket on it
+    assert(LfPush(q, &items[0]));
+    void *item;
+    void *batch[2];
+    assert(!queueTryDequeue(q, &item));
+    assert(queueTryDequeueMany(q, batch, 2) == 0);
+    // Anything beyond the reservations is fair game
+    assert(LfPush(q, &items[1]));
+    assert(queueTryDequeue(q, &item) && item == &items[0]);
+    assert(!queueTryDequeue(q, &item));
+    LfWakeWaiter(q);
+    thrd_join(consumer, NULL);
+    assert(slot == &items[1]);
+    assert(queueWaiting(q) == 0);
+    queueDestroy(q);
+
+    // Polling an empty locked queue does not take its lock
+    initQueue();
+    size_t seq = atomic_load(&defaultQueue.counters.seq);
+    assert(!tryDequeue(&item));
+    assert(tryDequeueMany(batch, 2) == 0);
+    assert(atomic_load(&defaultQueue.counters.seq) == seq);
+    enqueue(&items[2]);
+    assert(tryDequeue(&item) && item == &items[2]);
+    destroyQueue();
+
+    printf("tryDequeue reservations test passed.\n");
+}
+
+#define SPSC_ITEMS 200000
+
+int spsc_producer(void *arg)
+{
+    Queue *q = (Queue *)arg;
+    for (uintptr_t i = 1; i <= SPSC_ITEMS; i++)
+    {
+        // Mix in the non-blocking call; the ring is small, so both sides park
+        if (i % 3 != 0 || !queueTryEnqueue(q, (void *)i))
+        {
+            queueEnqueue(q, (void *)i);
+        }
+    }
+    return 0;
+}
+
+void test_spsc_queue()
+{
+    printf("=== Testing SPSC queue ===\n");
+
+    int items[4] = {0, 1, 2, 3};
+    assert(initQueueSpsc(3));  // Rounded up to 4 slots
+    void *item;
+    assert(!tryDequeue(&item));
+    for (int i = 0; i < 4; i++)
+    {
+        assert(tryEnqueue(&items[i]));
+    }
+    assert(!tryEnqueue(&items[0]));
+    assert(size() == 4);
+    assert(dequeue() == &items[0]);
+    assert(tryDequeue(&item) && item == &items[1]);
+    void *batch[4];
+    assert(tryDequeueMany(batch, 4) == 2);
+    assert(batch[0] == &items[2] && batch[1] == &items[3]);
+    assert(size() == 0);
+    assert(visited() == 4);
+
+    // A consumer asleep on the empty ring is woken by the producer
+    thrd_t consumer;
+    void *received = NULL;
+    thrd_create(&consumer, priority_consumer, &received);
+    while (waiting() == 0)
+    {
+        thrd_yield();
+    }
+    enqueue(&items[2]);
+    thrd_join(consumer, NULL);
+    assert(received == &items[2]);
+    destroyQueue();
+
+    // FIFO across a small ring, with both sides parking
+    Queue *q = queueCreateSpsc(16);
+    thrd_t producer;
+    thrd_create(&producer, spsc_producer, q);
+    for (uintptr_t i = 1; i <= SPSC_ITEMS;)
+    {
+        size_t n = i % 2 == 0 ? queueDequeueMany(q, batch, 4) : (batch[0] = queueDequeue(q), 1);
+        for (size_t k = 0; k < n; k++, i++)
+        {
+            assert((uintptr_t)batch[k] == i);
+        }
+    }
+    thrd_join(producer, NULL);
+    assert(queueSize(q) == 0);
+    assert(queueVisited(q) == SPSC_ITEMS);
+    assert(queueWaiting(q) == 0);
+    queueDestroy(q);
+
+    printf("SPSC queue test passed.\n");
+}
+
+void test_numa_placement()
+{
+    // Nodes that cannot be placed on fall back to the heap
+    Queue *q = queueCreateOnNode(0, 16);
+    assert(q->pool.numa_node == NumaNode(0));
+    queueEnqueue(q, (void *)1);
+    queueEnqueue(q, (void *)2);
+    assert(queueDequeue(q) == (void *)1);
+    assert(queueDequeue(q) == (void *)2);
+    queueDestroy(q);
+    q = queueCreateOnNode(1 << 20, 0);
+    assert(q->pool.numa_node == -1);
+    queueDestroy(q);
+
+    size_t nodes = NumaNodeCount() > 0 ? NumaNodeCount() : 1;
+    ShardedQueue *sq = shardedQueueCreateNuma(2);
+    assert(sq->node_count == nodes);
+    assert(sq->shard_count == 2 * nodes);
+    for (size_t i = 0; i < sq->shard_count; i++)
+    {
+        assert(sq->shards[i]->pool.numa_node == NumaNode((int)(i / 2)));
+    }
+    // The home shard is on the thread's node and is probed first
+    size_t home = HomeShard(sq);
+    assert(home / 2 == ThreadNumaNode() % nodes);
+    shardedEnqueue(sq, (void *)3);
+    assert(queueSize(sq->shards[home]) == 1);
+    assert(shardedDequeue(sq) == (void *)3);
+    shardedQueueDestroy(sq);
+
+    // Consumers drain their own node's shards before stealing remotely
+    ShardedQueue two_nodes = {.shard_count = 4, .node_count = 2, .shards_per_node = 2};
+    static const size_t probes[4][4] = {{0, 1, 2, 3}, {1, 0, 3, 2}, {2, 3, 0, 1}, {3, 2, 1, 0}};
+    for (size_t h = 0; h < 4; h++)
+    {
+        for (size_t i = 0; i < 4; i++)
+        {
+            assert(ShardProbe(&two_nodes, h, i) == probes[h][i]);
+        }
+    }
+    ShardedQueue one_node = {.shard_count = 3, .node_count = 1, .shards_per_node = 3};
+    for (size_t i = 0; i < 3; i++)
+    {
+        assert(ShardProbe(&one_node, 2, i) == (2 + i) % 3);
+    }
+
+    printf("NUMA placement test passed.\n");
+}
+
+typedef struct AnyConsumer
+{
+    Queue **qs;
+    size_t n;
+    size_t count;  // Items to take, stops early on NULL
+    size_t which;
+    void *item;
+    atomic_size_t taken;
+} AnyConsumer;
+
+int any_consumer(void *arg)
+{
+    AnyConsumer *c = (AnyConsumer *)arg;
+    for (size_t i = 0; i < c->count; i++)
+    {
+        c->item = dequeueAny(c->qs, c->n, &c->which);
+        if (c->item == NULL)
+        {
+            break;
+        }
+        atomic_fetch_add(&c->taken, 1);
+    }
+    return 0;
+}
+
+#define ANY_ITEMS 20000
+
+int any_producer(void *arg)
+{
+    Queue *q = (Queue *)arg;
+    for (uintptr_t i = 1; i <= ANY_ITEMS; i++)
+    {
+        queueEnqueue(q, (void *)i);
+    }
+    return 0;
+}
+
+void wait_for_waiters(Queue **qs, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        while (queueWaiting(qs[i]) == 0)
+        {
+            thrd_yield();
+        }
+    }
+}
+
+void test_dequeue_any()
+{
+    printf("=== Testing dequeueAny ===\n");
+
+    int items[3] = {0, 1, 2};
+    Queue *qs[3] = {queueCreate(), queueCreateBounded(4), queueCreateLockFree(4)};
+    size_t which;
+
+    // Items already queued are taken without parking
+    queueEnqueue(qs[1], &items[1]);
+    assert(dequeueAny(qs, 3, &which) == &items[1] && which == 1);
+
+    // One park across every mode; the other records are cancelled after
+    for (size_t target = 0; target < 3; target++)
+    {
+        AnyConsumer c = {.qs = qs, .n = 3, .count = 1};
+        thrd_t consumer;
+        thrd_create(&consumer, any_consumer, &c);
+        wait_for_waiters(qs, 3);
+        queueEnqueue(qs[target], &items[target]);
+        thrd_join(consumer, NULL);
+        assert(c.item == &items[target] && c.which == target);
+        for (size_t i = 0; i < 3; i++)
+        {
+            assert(queueWaiting(qs[i]) == 0);
+            assert(queueSize(qs[i]) == 0);
+        }
+    }
+
+    // A sleeper takes exactly one item however many queues fill up at once
+    AnyConsumer c = {.qs = qs, .n = 3, .count = 1};
+    thrd_t consumer;
+    thrd_create(&consumer, any_consumer, &c);
+    wait_for_waiters(qs, 3);
+    for (size_t i = 0; i < 3; i++)
+    {
+        queueEnqueue(qs[i], &items[i]);
+    }
+    thrd_join(consumer, NULL);
+    assert(c.item != NULL);
+    assert(queueSize(qs[0]) + queueSize(qs[1]) + queueSize(qs[2]) == 2);
+    for (size_t i = 0; i < 3; i++)
+    {
+        void *item;
+        assert(queueTryDequeue(qs[i], &item) == (i != c.which));
+    }
+
+    // Closing one queue keeps waiting on the rest, closing all returns NULL
+    c = (AnyConsumer){.qs = qs, .n = 3, .count = 2};
+    thrd_create(&consumer, any_consumer, &c);
+    wait_for_waiters(qs, 3);
+    queueClose(qs[0]);
+    queueEnqueue(qs[2], &items[2]);
+    while (atomic_load(&c.taken) == 0)
+    {
+        thrd_yield();
+    }
+    assert(c.item == &items[2] && c.which == 2);
+    queueClose(qs[1]);
+    queueClose(qs[2]);
+    thrd_join(consumer, NULL);
+    assert(c.item == NULL && atomic_load(&c.taken) == 1);
+    assert(dequeueAny(qs, 3, NULL) == NULL);
+    for (size_t i = 0; i < 3; i++)
+    {
+        queueDestroy(qs[i]);
+    }
+
+    // A queue destroyed under a sleeper is let go; it waits on the rest
+    Queue *pair[2] = {queueCreate(), queueCreateBounded(4)};
+    c = (AnyConsumer){.qs = pair, .n = 2, .count = 1};
+    thrd_create(&consumer, any_consumer, &c);
+    wait_for_waiters(pair, 2);
+    queueDestroy(pair[0]);
+    queueEnqueue(pair[1], &items[1]);
+    thrd_join(consumer, NULL);
+    assert(c.item == &items[1] && c.which == 1);
+    queueDestroy(pair[1]);
+
+    // Producers on four queues, consumers selecting over all of them
+    Queue *many[4] = {queueCreate(), queueCreateBounded(8), queueCreateLockFree(8), queueCreate()};
+    AnyConsumer consumers[2] = {{.qs = many, .n = 4, .count = SIZE_MAX},
+                                {.qs = many, .n = 4, .count = SIZE_MAX}};
+    thrd_t threads[6];
+    for (int i = 0; i < 2; i++)
+    {
+        thrd_create(&threads[i], any_consumer, &consumers[i]);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        thrd_create(&threads[2 + i], any_producer, many[i]);
+    }
+    for (int i = 2; i < 6; i++)
+    {
+        thrd_join(threads[i], NULL);
+    }
+    while (atomic_load(&consumers[0].taken) + atomic_load(&consumers[1].taken) < 4 * ANY_ITEMS)
+    {
+        thrd_yield();
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        queueClose(many[i]);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        thrd_join(threads[i], NULL);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        assert(queueSize(many[i]) == 0);
+        assert(queueWaiting(many[i]) == 0);
+        queueDestroy(many[i]);
+    }
+
+    printf("dequeueAny test passed.\n");
+}
+
+typedef struct Point
+{
+    int16_t x, y;
+} Point;
+
+DEFINE_QUEUE(IntQueue, int)
+DEFINE_QUEUE(DoubleQueue, double)
+DEFINE_QUEUE(PointQueue, Point)
+
+int typed_consumer(void *arg)
+{
+    IntQueue *q = (IntQueue *)arg;
+    int value;
+    int sum = 0;
+    while (IntQueueDequeue(q, &value))
+    {
+        sum += value;
+    }
+    return sum;
+}
+
+void test_typed_queue()
+{
+    printf("=== Testing typed queue ===\n");
+
+    // Values live in the node itself, zero included
+    IntQueue *q = IntQueueCreate();
+    int values[] = {0, -1, 42, 0};
+    for (int i = 0; i < 4; i++)
+    {
+        IntQueueEnqueue(q, values[i]);
+    }
+    assert(IntQueueSize(q) == 4);
+    int value;
+    for (int i = 0; i < 4; i++)
+    {
+        assert(IntQueueTryDequeue(q, &value) && value == values[i]);
+    }
+    assert(!IntQueueTryDequeue(q, &value));
+
+    // Blocking dequeue with the usual close semantics
+    thrd_t consumer;
+    int sum;
+    thrd_create(&consumer, typed_consumer, q);
+    for (int i = 1; i <= 100; i++)
+    {
+        IntQueueEnqueue(q, i);
+    }
+    IntQueueClose(q);
+    thrd_join(consumer, &sum);
+    assert(sum == 5050);
+    assert(!IntQueueDequeue(q, &value));
+    IntQueueDestroy(q);
+
+    DoubleQueue *dq = DoubleQueueCreateLockFree(4);
+    assert(DoubleQueueTryEnqueue(dq, 0.5));
+    DoubleQueueEnqueue(dq, -2.25);
+    double d;
+    assert(DoubleQueueDequeue(dq, &d) && d == 0.5);
+    assert(DoubleQueueDequeueFor(dq, &d, &(struct timespec){0, 1000000}) && d == -2.25);
+    assert(!DoubleQueueDequeueFor(dq, &d, &(struct timespec){0, 1000000}));
+    assert(queueSize(DoubleQueueQueue(dq)) == 0);
+    DoubleQueueDestroy(dq);
+
+    PointQueue *pq = PointQueueCreateBounded(2);
+    PointQueueEnqueue(pq, (Point){3, -4});
+    Point p;
+    assert(PointQueueDequeue(pq, &p) && p.x == 3 && p.y == -4);
+    PointQueueDestroy(pq);
+
+    printf("typed queue test passed.\n");
+}
+
+typedef struct ExpiredItems
+{
+    Queue *q;
+    size_t calls;
+    size_t count;
+    int sum;
+} ExpiredItems;
+
+void collect_expired(void **items, size_t count, void *ctx)
+{
+    ExpiredItems *expired = (ExpiredItems *)ctx;
+    // Takes the lock of q, which must not be held while we run
+    queueSetReclaim(expired->q, collect_expired, ctx);
+    for (size_t i = 0; i < count; i++)
+    {
+        expired->sum += *(int *)items[i];
+    }
+    expired->calls++;
+    expired->count += count;
+}
+
+struct timespec deadline_in(long ms)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += ms % 1000 * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    else if (ts.tv_nsec < 0)
+    {
+        ts.tv_sec--;
+        ts.tv_nsec += 1000000000L;
+    }
+    return ts;
+}
+
+void test_item_deadlines()
+{
+    printf("=== Testing item deadlines ===\n");
+
+    int items[] = {1, 2, 3, 4, 5, 6};
+    ExpiredItems expired = {0};
+    void *item;
+
+    Queue *q = queueCreate();
+    expired.q = q;
+    queueSetReclaim(q, collect_expired, &expired);
+
+    // Already expired on arrival
+    struct timespec past = deadline_in(-1000);
+    queueEnqueueWithDeadline(q, &items[0], &past);
+    assert(expired.count == 1 && queueSize(q) == 0);
+
+    // Size only counts live items; the expired front goes in one batch
+    struct timespec soon = deadline_in(20);
+    struct timespec later = deadline_in(60000);
+    queueEnqueueWithDeadline(q, &items[1], &soon);
+    queueEnqueueWithDeadline(q, &items[2], &soon);
+    queueEnqueueWithPriority(q, &items[3], 0);
+    queueEnqueueWithDeadline(q, &items[4], &soon);  // Behind a live item
+    queueEnqueueWithDeadline(q, &items[5], &later);
+    assert(queueSize(q) == 5);
+    thrd_sleep(&(struct timespec){0, 40000000}, NULL);
+    assert(queueSize(q) == 2);
+    assert(expired.calls == 2 && expired.count == 3 && expired.sum == 1 + 2 + 3);
+    assert(queueSnapshotStats(q).size == 2);
+    assert(queueTryDequeue(q, &item) && *(int *)item == 4);
+    assert(queueDequeue(q) == &items[5]);
+    assert(expired.count == 4);
+    assert(!queueTryDequeue(q, &item));
+    queueDestroy(q);
+
+    // An expired item between live ones is skipped within one batch
+    for (int bounded = 0; bounded < 2; bounded++)
+    {
+        q = bounded ? queueCreateBounded(8) : queueCreate();
+        assert(q != NULL);
+        expired = (ExpiredItems){.q = q};
+        queueSetReclaim(q, collect_expired, &expired);
+        soon = deadline_in(20);
+        queueEnqueue(q, &items[0]);
+        queueEnqueueWithDeadline(q, &items[1], &soon);
+        queueEnqueue(q, &items[2]);
+        thrd_sleep(&(struct timespec){0, 40000000}, NULL);
+        assert(queueSize(q) == 2 && queueSnapshotStats(q).size == 2 && expired.count == 0);
+        void *batch[8];
+        size_t n = bounded ? queueDequeueMany(q, batch, 8) : queueTryDequeueMany(q, batch, 8);
+        assert(n == 2 && batch[0] == &items[0] && batch[1] == &items[2]);
+        assert(expired.count == 1 && expired.sum == 2);
+        queueDestroy(q);
+    }
+
+    // Expired items give their ring slots back to blocked producers
+    q = queueCreateBounded(4);
+    expired = (ExpiredItems){.q = q};
+    queueSetReclaim(q, collect_expired, &expired);
+    soon = deadline_in(20);
+    for (int i = 0; i < 4; i++)
+    {
+        queueEnqueueWithDeadline(q, &items[i], &soon);
+    }
+    assert(!queueTryEnqueue(q, &items[4]));
+    thrd_sleep(&(struct timespec){0, 40000000}, NULL);
+    assert(queueTryEnqueue(q, &items[4]));
+    assert(expired.count == 4 && expired.sum == 1 + 2 + 3 + 4);
+    assert(queueTryDequeue(q, &item) && *(int *)item == 5);
+    queueDestroy(q);
+
+    // Lock-free slots have no deadline, the item is kept
+    q = queueCreateLockFree(4);
+    queueEnqueueWithDeadline(q, &items[0], &past);
+    assert(queueTryDequeue(q, &item) && item == &items[0]);
+    queueDestroy(q);
+
+    printf("item deadlines test passed.\n");
+}
+
+typedef struct Record
+{
+    int id;
+    char name[12];
+} Record;
+
+int persistent_producer(void *arg)
+{
+    Record record = {5, "five"};
+    return queueEnqueueCopy((Queue *)arg, &record);
+}
+
+void test_persistent_queue()
+{
+    printf("=== Testing persistent queue ===\n");
+
+    char path[] = "/tmp/queue_test.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    Queue *q = queueCreatePersistent(path, 4, sizeof(Record));
+    assert(q != NULL);
+    Record records[] = {{1, "one"}, {2, "two"}, {3, "three"}, {4, "four"}};
+    Record record;
+    assert(!queueTryDequeueCopy(q, &record));
+    for (int i = 0; i < 3; i++)
+    {
+        assert(queueEnqueueCopy(q, &records[i]));
+    }
+    assert(queueDequeueCopy(q, &record) && record.id == 1 && strcmp(record.name, "one") == 0);
+    queueDestroy(q);
+
+    // Reopening resumes where the last handle left off
+    assert(queueCreatePersistent(path, 4, sizeof(int)) == NULL);
+    q = queueCreatePersistent(path, 4, sizeof(Record));
+    assert(q != NULL && queueSize(q) == 2);
+    assert(queueTryDequeueCopy(q, &record) && record.id == 2);
+
+    // The pointer calls reject a persistent queue, the copy calls any other
+    void *item;
+    void *items[] = {&records[0], &records[1]};
+    struct timespec later = deadline_in(1000);
+    queueEnqueue(q, &records[0]);
+    queueEnqueueMany(q, items, 2);
+    queueEnqueueWithDeadline(q, &records[0], &later);
+    assert(!queueTryEnqueue(q, &records[0]));
+    assert(queueSize(q) == 1);
+    assert(!queueTryDequeue(q, &item) && queueDequeue(q) == NULL);
+    assert(queueTryDequeueMany(q, items, 2) == 0 && queueDequeueMany(q, items, 2) == 0);
+    assert(dequeueAny(&q, 1, NULL) == NULL);
+    assert(queueSize(q) == 1);
+    Queue *plain = queueCreate();
+    assert(!queueEnqueueCopy(plain, &records[0]) && !queueSync(plain));
+    assert(!queueTryDequeueCopy(plain, &record) && !queueDequeueCopy(plain, &record));
+    queueDestroy(plain);
+
+    // A second mapping sees only what was committed, as after a crash
+    assert(queueSync(q));
+    assert(queueEnqueueCopy(q, &records[3]));
+    Queue *recovered = queueCreatePersistent(path, 4, sizeof(Record));
+    assert(recovered != NULL && queueSize(recovered) == 1);
+    queueDestroy(recovered);
+    assert(queueSize(q) == 2);
+
+    // Fill the ring; a blocked producer gets the slot once it is committed
+    assert(queueEnqueueCopy(q, &records[0]));
+    assert(queueEnqueueCopy(q, &records[1]));
+    thrd_t producer;
+    int stored;
+    thrd_create(&producer, persistent_producer, q);
+    assert(queueDequeueCopy(q, &record) && record.id == 3);
+    thrd_join(producer, &stored);
+    assert(stored && queueSize(q) == 4);
+
+    queueClose(q);
+    assert(!queueEnqueueCopy(q, &records[0]));
+    int expected[] = {4, 1, 2, 5};
+    for (int i = 0; i < 4; i++)
+    {
+        assert(queueDequeueCopy(q, &record) && record.id == expected[i]);
+    }
+    assert(!queueDequeueCopy(q, &record));
+    queueDestroy(q);
+
+    // A torn commit record is skipped in favour of the one before it
+    q = queueCreatePersistent(path, 4, sizeof(Record));
+    assert(q != NULL && queueSize(q) == 0);
+    assert(queueEnqueueCopy(q, &records[0]) && queueSync(q));
+    assert(queueEnqueueCopy(q, &records[1]));
+    queueDestroy(q);
+    PersistHeader header;
+    fd = open(path, O_RDWR);
+    assert(fd >= 0 && pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header));
+    size_t newest = header.commits[1].seq > header.commits[0].seq;
+    assert(header.commits[newest].tail - header.commits[newest].head == 2);
+    header.commits[newest].tail++;
+    assert(pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header));
+    q = queueCreatePersistent(path, 4, sizeof(Record));
+    assert(q != NULL && queueSize(q) == 1);
+    assert(queueDequeueCopy(q, &record) && record.id == 1);
+    queueDestroy(q);
+
+    // A file cut short before its magic was stamped starts over
+    memset(&header, 0, sizeof(header));
+    assert(pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header));
+    close(fd);
+    q = queueCreatePersistent(path, 4, sizeof(Record));
+    assert(q != NULL && queueSize(q) == 0);
+    assert(queueEnqueueCopy(q, &records[2]));
+    queueDestroy(q);
+    q = queueCreatePersistent(path, 4, sizeof(Record));
+    assert(q != NULL && queueDequeueCopy(q, &record) && record.id == 3);
+    queueDestroy(q);
+
+    unlink(path);
+
+    printf("persistent queue test passed.\n");
+}
+
+typedef struct BatchProducer
+{
+    Queue *q;
+    void **items;
+    size_t count;
+} BatchProducer;
+
+int batch_producer(void *arg)
+{
+    BatchProducer *producer = (BatchProducer *)arg;
+    queueEnqueueMany(producer->q, producer->items, producer->count);
+    return 0;
+}
+
+int queue_enqueue_one(void *arg)
+{
+    BatchProducer *producer = (BatchProducer *)arg;
+    queueEnqueue(producer->q, producer->items[0]);
+    return 0;
+}
+
+void wait_for_producers(Queue *q, size_t n)
+{
+    while (queueWaitingProducers(q) < n)
+    {
+        thrd_yield();
+    }
+}
+
+void test_producer_wait_queue()
+{
+    printf("=== Testing producer wait queue ===\n");
+
+    int items[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+    void *item;
+    Queue *q = queueCreateBounded(2);
+    queueSetSpinLimit(q, 0);
+    assert(queueWaitingProducers(q) == 0);
+
+    // Producers blocked on a full ring are served in arrival order, a batch
+    // producer counting as one; tryEnqueue never overtakes them
+    queueEnqueue(q, &items[0]);
+    queueEnqueue(q, &items[1]);
+    void *batch[] = {&items[3], &items[4], &items[5]};
+    void *single[] = {&items[2], &items[6]};
+    BatchProducer producers[] = {{q, &single[0], 1}, {q, batch, 3}, {q, &single[1], 1}};
+    thrd_t ids[3];
+    thrd_create(&ids[0], queue_enqueue_one, &producers[0]);
+    wait_for_producers(q, 1);
+    thrd_create(&ids[1], batch_producer, &producers[1]);
+    wait_for_producers(q, 2);
+    thrd_create(&ids[2], queue_enqueue_one, &producers[2]);
+    wait_for_producers(q, 3);
+    assert(waitingProducers() == 0);
+
+    assert(queueTryDequeue(q, &item) && item == &items[0]);
+    assert(!queueTryEnqueue(q, &items[7]));
+    for (int i = 1; i <= 6; i++)
+    {
+        assert(queueDequeue(q) == &items[i]);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        thrd_join(ids[i], NULL);
+    }
+    assert(queueWaitingProducers(q) == 0 && queueSize(q) == 0);
+
+    // Closing releases parked producers with their items
+    queueEnqueue(q, &items[0]);
+    queueEnqueue(q, &items[1]);
+    thrd_create(&ids[0], queue_enqueue_one, &producers[0]);
+    wait_for_producers(q, 1);
+    queueClose(q);
+    thrd_join(ids[0], NULL);
+    assert(queueWaitingProducers(q) == 0 && queueSize(q) == 2);
+    queueDestroy(q);
+
+    printf("producer wait queue test passed.\n");
+}
+
+#define ASYNC_ITEMS 100000
+
+typedef struct AsyncConsumer
+{
+    Queue *q;
+    size_t calls;
+    size_t nulls;
+    void *last;
+    bool rearm;  // Register again from the callback until the queue is closed
+} AsyncConsumer;
+
+void async_callback(void *item, void *ctx)
+{
+    AsyncConsumer *consumer = (AsyncConsumer *)ctx;
+    consumer->calls++;
+    if (item == NULL)
+    {
+        consumer->nulls++;
+        return;
+    }
+    consumer->last = item;
+    if (consumer->rearm)
+    {
+        assert(queueDequeueAsync(consumer->q, async_callback, consumer));
+    }
+}
+
+typedef struct AsyncTask
+{
+    QueueAsyncFn fn;
+    void *item;
+    void *ctx;
+} AsyncTask;
+
+typedef struct AsyncExecutor
+{
+    AsyncTask tasks[4];
+    size_t count;
+} AsyncExecutor;
+
+int async_blocking_consumer(void *arg)
+{
+    AsyncConsumer *consumer = (AsyncConsumer *)arg;
+    consumer->last = queueDequeue(consumer->q);
+    return 0;
+}
+
+void defer_task(QueueAsyncFn fn, void *item, void *fn_ctx, void *ctx)
+{
+    AsyncExecutor *executor = (AsyncExecutor *)ctx;
+    assert(executor->count < 4);
+    executor->tasks[executor->count++] = (AsyncTask){fn, item, fn_ctx};
+}
+
+void test_dequeue_async()
+{
+    printf("=== Testing dequeueAsync ===\n");
+
+    int items[4] = {0, 1, 2, 3};
+    Queue *q = queueCreate();
+
+    // An available item is delivered before the call returns
+    AsyncConsumer a = {q, 0, 0, NULL, false};
+    queueEnqueue(q, &items[0]);
+    assert(queueDequeueAsync(q, async_callback, &a));
+    assert(a.calls == 1 && a.last == &items[0] && queueWaiting(q) == 0);
+
+    // Async records keep their FIFO place among blocking waiters
+    thrd_t consumer;
+    AsyncConsumer blocking = {q, 0, 0, NULL, false};
+    thrd_create(&consumer, async_blocking_consumer, &blocking);
+    wait_for_waiters(&q, 1);
+    AsyncConsumer b = {q, 0, 0, NULL, false};
+    AsyncConsumer c = {q, 0, 0, NULL, false};
+    assert(queueDequeueAsync(q, async_callback, &b));
+    assert(queueDequeueAsync(q, async_callback, &c));
+    assert(queueWaiting(q) == 3 && b.calls == 0 && c.calls == 0);
+    for (int i = 1; i <= 3; i++)
+    {
+        queueEnqueue(q, &items[i]);
+    }
+    thrd_join(consumer, NULL);
+    assert(blocking.last == &items[1]);
+    assert(b.calls == 1 && b.last == &items[2]);
+    assert(c.calls == 1 && c.last == &items[3]);
+
+    // Callbacks go through the executor, and closing releases records with NULL
+    AsyncExecutor executor = {.count = 0};
+    queueSetExecutor(q, defer_task, &executor);
+    AsyncConsumer d = {q, 0, 0, NULL, false};
+    assert(queueDequeueAsync(q, async_callback, &d));
+    assert(queueDequeueAsync(q, async_callback, &d));
+    queueEnqueue(q, &items[0]);
+    queueClose(q);
+    assert(d.calls == 0 && executor.count == 2);
+    for (size_t i = 0; i < executor.count; i++)
+    {
+        executor.tasks[i].fn(executor.tasks[i].item, executor.tasks[i].ctx);
+    }
+    assert(d.calls == 2 && d.nulls == 1 && d.last == &items[0]);
+    queueDestroy(q);
+
+    // A callback that registers again drains a long queue without
+    // recursing once per item
+    q = queueCreateLockFree(ASYNC_ITEMS);
+    for (int i = 0; i < ASYNC_ITEMS; i++)
+    {
+        queueEnqueue(q, &items[i % 4]);
+    }
+    AsyncConsumer e = {q, 0, 0, NULL, true};
+    assert(queueDequeueAsync(q, async_callback, &e));
+    assert(e.calls == ASYNC_ITEMS && queueSize(q) == 0);
+    queueEnqueue(q, &items[1]);
+    assert(e.calls == ASYNC_ITEMS + 1 && e.last == &items[1]);
+    queueDestroy(q);
+    assert(e.nulls == 1);
+
+    // The SPSC ring only has room for one popping thread
+    q = queueCreateSpsc(4);
+    AsyncConsumer f = {q, 0, 0, NULL, false};
+    assert(!queueDequeueAsync(q, async_callback, &f));
+    queueEnqueue(q, &items[0]);
+    assert(!queueDequeueAsync(q, async_callback, &f) && f.calls == 0);
+    queueDestroy(q);
+
+    printf("dequeueAsync test passed.\n");
+}
+
 int dequeue_with_wait(void *arg)
 {
     struct timespec *sleep_time = (struct timespec *)arg;
@@ -423,15 +2420,16 @@ int enqueue_thread(void *arg)
     *item = thrd_current(); // Set item value to thread index
 
     enqueue(item);
-    printf("Thread %lx enqueued item: %lx\n", thrd_current(), *item);
 
     return 0;
 }
 
 int dequeue_thread(void *arg)
 {
+    // No printing here: it serializes the threads and hides races. See
+    // stress.c for checked histories under real load.
     unsigned long *item = (unsigned long *)dequeue();
-    printf("Thread %lx dequeued item: %lx\n", thrd_current(), *item);
+    assert(item != NULL);
     // free(item);
 
     return 0;
@@ -463,59 +2461,54 @@ void test_mixed_operations()
     // Enqueue items
     int item1 = 1;
     enqueue(&item1);
-    printf("Enqueued item: %d\n", item1);
 
     // Try dequeue
     void *tryDequeueItem;
-    if (tryDequeue(&tryDequeueItem))
-    {
-        int *dequeuedItem = (int *)tryDequeueItem;
-        printf("Dequeued item: %d\n", *dequeuedItem);
-    }
+    assert(tryDequeue(&tryDequeueItem));
+    assert(*(int *)tryDequeueItem == 1);
 
     // Enqueue more items
     int item2 = 2;
     enqueue(&item2);
-    printf("Enqueued item: %d\n", item2);
 
     int item3 = 3;
     enqueue(&item3);
-    printf("Enqueued item: %d\n", item3);
 
     // Dequeue an item
     int *dequeuedItem = (int *)dequeue();
-    printf("Dequeued item: %d\n", *dequeuedItem);
+    assert(*dequeuedItem == 2);
 
     // Enqueue another item
     int item4 = 4;
     enqueue(&item4);
-    printf("Enqueued item: %d\n", item4);
 
     // Try dequeue multiple times
+    int expected[] = {3, 4};
     for (int i = 0; i < 3; i++)
     {
-        if (tryDequeue(&tryDequeueItem))
+        bool dequeued = tryDequeue(&tryDequeueItem);
+        assert(dequeued == (i < 2));
+        if (dequeued)
         {
-            int *dequeuedItem = (int *)tryDequeueItem;
-            printf("Dequeued item: %d\n", *dequeuedItem);
+            assert(*(int *)tryDequeueItem == expected[i]);
         }
     }
 
     // Enqueue additional items
     int item5 = 5;
     enqueue(&item5);
-    printf("Enqueued item: %d\n", item5);
 
     int item6 = 6;
     enqueue(&item6);
-    printf("Enqueued item: %d\n", item6);
 
     // Dequeue remaining items
+    int next = 5;
     while (size() > 0)
     {
         int *dequeuedItem = (int *)dequeue();
-        printf("Dequeued item: %d\n", *dequeuedItem);
+        assert(*dequeuedItem == next++);
     }
+    assert(next == 7);
 
     destroyQueue();
 
@@ -528,6 +2521,32 @@ int main()
     test_enqueue_dequeue();
     test_tryDequeue();
     test_size();
+    test_initQueueReserve();
+    test_bounded_queue();
+    test_batch_operations();
+    test_lockfree_queue();
+    test_queue_instances();
+    test_sharded_queue();
+    test_targeted_wakeup();
+    test_timed_dequeue();
+    test_spin_then_park();
+    test_snapshot_stats();
+    test_cache_line_layout();
+    test_priority_enqueue();
+    test_close_and_drain();
+    test_notify_fd();
+    test_producer_buffer();
+    test_queue_stats();
+    test_intrusive_queue();
+    test_try_dequeue_reservations();
+    test_spsc_queue();
+    test_numa_placement();
+    test_dequeue_any();
+    test_typed_queue();
+    test_item_deadlines();
+    test_persistent_queue();
+    test_producer_wait_queue();
+    test_dequeue_async();
     test_waiting();
     test_basic_concurrent_enqueue_dequeue();
     test_fifo_order();